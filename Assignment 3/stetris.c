@@ -1,3 +1,7 @@
+// Build with: gcc -O2 -pthread -o stetris stetris.c
+
+#define _GNU_SOURCE // ppoll()
+
 #include <stdio.h>
 #include <stdlib.h>
 #include <unistd.h>
@@ -14,6 +18,13 @@
 #include <linux/fb.h>
 #include <sys/mman.h>
 #include <dirent.h>
+#include <limits.h>
+#include <stdarg.h>
+#include <errno.h>
+#include <signal.h>
+#include <pthread.h>
+#include <semaphore.h>
+#include <stdatomic.h>
 
 // The game state can be used to detect what happens on the playfield
 #define GAMEOVER 0
@@ -21,13 +32,19 @@
 #define ROW_CLEAR (1 << 1)
 #define TILE_ADDED (1 << 2)
 
-// If you extend this structure, either avoid pointers or adjust
-// the game logic allocate/deallocate and reset the memory
-typedef struct
-{
-	bool occupied;
-	u_int16_t color;
-} tile;
+// The playfield occupancy is kept as a bitboard, bit x % 64 of word x / 64
+// of a row is set when the tile in column x is occupied. The tile colors live
+// in a separate array next to it. Empty tiles always have color 0, so the
+// color array is also the RGB565 image of the field.
+//
+// Both are flat, cache line aligned arrays addressed with a row stride. The
+// rows are stored as a ring: row y of the playfield is stored in row
+// (rowBase + y) % grid.y, so clearing the bottom row only moves rowBase
+// instead of copying every row above it down.
+typedef u_int64_t rowbits;
+#define ROWBITS 64
+#define GRID_MAX 65536 // largest number of columns and rows
+#define CACHE_LINE 64
 
 typedef struct
 {
@@ -37,8 +54,8 @@ typedef struct
 
 typedef struct
 {
-	coord const grid;					  // playfield bounds
-	unsigned long const uSecTickTime;	  // tick rate
+	coord grid;							  // playfield bounds
+	unsigned long uSecTickTime;		  // tick rate
 	unsigned long const rowsPerLevel;	  // speed up after clearing rows
 	unsigned long const initNextGameTick; // initial value of nextGameTick
 
@@ -47,8 +64,15 @@ typedef struct
 	unsigned int score; // game score
 	unsigned int level; // game level
 
-	tile *rawPlayfield; // pointer to raw memory of the playfield
-	tile **playfield;	// This is the play field array
+	rowbits *occupied;		  // occupancy bitboard, words per row
+	u_int16_t *colors;		  // tile colors, colorStride entries per row
+	rowbits *dirty;			  // tiles changed since the last frame, same layout as occupied
+	rowbits *dirtyRows;		  // stored rows with dirty tiles, one bit per row
+	bool dirtyAll;			  // every tile changed since the last frame
+	unsigned int words;		  // occupancy words per row
+	unsigned int colorStride; // colors per row, padded to full cache lines
+	unsigned int rowBase;	  // stored row of playfield row 0
+	rowbits lastWordMask;	  // occupancy of the last word of a filled row
 	unsigned int state;
 	coord activeTile; // current tile
 
@@ -58,7 +82,8 @@ typedef struct
 								// lowers with increasing level, never reaches 0
 } gameConfig;
 
-gameConfig game = {
+// Every thread plays its own game instance, see the tournament runner
+_Thread_local gameConfig game = {
 	.grid = {8, 8},
 	.uSecTickTime = 10000,
 	.rowsPerLevel = 2,
@@ -70,66 +95,351 @@ struct fb_fix_screeninfo fixed_screen_info;
 u_int16_t *fbmapping;
 
 int jsfd; // File descritor for joystick
+bool jsMonotonic; // Are the joystick event timestamps taken from CLOCK_MONOTONIC?
 
-// This function is called on the start of your application
-// Here you can initialize what ever you need for your task
-// return false if something fails, else true
-bool initializeSenseHat()
+inline unsigned long uSecFromTimespec(struct timespec const ts)
+{
+	return ((ts.tv_sec * 1000000) + (ts.tv_nsec / 1000));
+}
+
+static inline unsigned long long nSecFromTimespec(struct timespec const ts)
+{
+	return ((ts.tv_sec * 1000000000ull) + ts.tv_nsec);
+}
+
+static inline unsigned long long nSecNow()
+{
+	struct timespec now;
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	return nSecFromTimespec(now);
+}
+
+static void sleepUntil(unsigned long long const nSecTime)
+{
+	struct timespec const until = {nSecTime / 1000000000ull, nSecTime % 1000000000ull};
+	while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &until, NULL) == EINTR)
+	{
+	}
+}
+
+// Key presses of the joystick and the keyboard are collected in a small ring
+// buffer together with the time they happened, so that every press reaches
+// sTetris() in order, even when several arrive within one tick
+#define INPUT_QUEUE_SIZE 64 // must be a power of two
+
+typedef struct
+{
+	int key;
+	unsigned long long nSecTime; // CLOCK_MONOTONIC time of the key press
+} inputEvent;
+
+typedef struct
+{
+	inputEvent events[INPUT_QUEUE_SIZE];
+	unsigned int head;		// next event to pop
+	unsigned int tail;		// next free slot
+	unsigned long dropped; // presses lost because the queue was full
+} inputQueue;
+
+static inline void pushInput(inputQueue *const queue, int const key, unsigned long long const nSecTime)
+{
+	if (queue->tail - queue->head == INPUT_QUEUE_SIZE)
+	{
+		queue->dropped++;
+		return;
+	}
+	queue->events[queue->tail++ % INPUT_QUEUE_SIZE] = (inputEvent){key, nSecTime};
+}
+
+static inline bool popInput(inputQueue *const queue, inputEvent *const event)
+{
+	if (queue->head == queue->tail)
+		return false;
+	*event = queue->events[queue->head++ % INPUT_QUEUE_SIZE];
+	return true;
+}
+
+
+// Instrumentation of the game loop. Durations are recorded in nanoseconds
+// into log-linear histograms in the style of HdrHistogram: every power of two
+// is split into HISTOGRAM_SUB_BUCKETS linear buckets, so every recorded value
+// is kept with a relative error below 1 / HISTOGRAM_SUB_BUCKETS. When it is
+// not enabled with -m nothing is timed or recorded.
+#define HISTOGRAM_SUB_BITS 4
+#define HISTOGRAM_SUB_BUCKETS (1 << HISTOGRAM_SUB_BITS)
+#define HISTOGRAM_BUCKETS ((64 - HISTOGRAM_SUB_BITS + 1) * HISTOGRAM_SUB_BUCKETS)
+
+typedef struct
+{
+	char const *name;
+	atomic_ulong counts[HISTOGRAM_BUCKETS];
+	atomic_ulong samples;
+	atomic_ullong nSecTotal;
+	atomic_ullong nSecMax;
+} histogram;
+
+bool metricsEnabled = false;
+volatile sig_atomic_t metricsDumpRequested = 0; // set by SIGUSR1
+
+histogram tickJitter = {.name = "tick jitter"};		 // tick start off its schedule, ahead when input woke it up
+histogram inputTime = {.name = "tick input"};		 // reading the input devices
+histogram logicTime = {.name = "tick logic"};		 // sTetris() with all queued keys
+histogram publishTime = {.name = "tick publish"};	 // handing the frame to the render thread
+histogram renderTime = {.name = "render frame"};	 // console and LED matrix output
+histogram inputLatency = {.name = "input to LEDs"}; // key press timestamp to framebuffer write
+
+histogram *const metrics[] = {&tickJitter, &inputTime, &logicTime, &publishTime, &renderTime, &inputLatency};
+
+static inline unsigned int histogramBucket(unsigned long long const value)
+{
+	if (value < HISTOGRAM_SUB_BUCKETS)
+		return value;
+	unsigned int const shift = 63 - __builtin_clzll(value) - HISTOGRAM_SUB_BITS;
+	return (shift + 1) * HISTOGRAM_SUB_BUCKETS + ((value >> shift) - HISTOGRAM_SUB_BUCKETS);
+}
+
+// Highest value that is counted in the bucket
+static inline unsigned long long histogramBucketValue(unsigned int const bucket)
+{
+	if (bucket < HISTOGRAM_SUB_BUCKETS)
+		return bucket;
+	unsigned int const shift = bucket / HISTOGRAM_SUB_BUCKETS - 1;
+	return (((unsigned long long)(bucket % HISTOGRAM_SUB_BUCKETS + HISTOGRAM_SUB_BUCKETS + 1)) << shift) - 1;
+}
+
+// Safe to call from several threads, e.g. the tournament workers all time
+// their lookahead decisions in the same histogram. The atomics also let the
+// dump read them from another thread.
+void recordHistogram(histogram *const h, unsigned long long const nSec)
+{
+	atomic_fetch_add_explicit(&h->counts[histogramBucket(nSec)], 1, memory_order_relaxed);
+	atomic_fetch_add_explicit(&h->samples, 1, memory_order_relaxed);
+	atomic_fetch_add_explicit(&h->nSecTotal, nSec, memory_order_relaxed);
+	unsigned long long seen = atomic_load_explicit(&h->nSecMax, memory_order_relaxed);
+	while (nSec > seen &&
+		   !atomic_compare_exchange_weak_explicit(&h->nSecMax, &seen, nSec, memory_order_relaxed, memory_order_relaxed))
+	{
+	}
+}
+
+static unsigned long long histogramPercentile(histogram const *const h, unsigned long const samples, double const percentile)
+{
+	unsigned long const target = (unsigned long)(samples * percentile / 100.0 + 0.5);
+	unsigned long long const nSecMax = atomic_load_explicit(&h->nSecMax, memory_order_relaxed);
+	unsigned long seen = 0;
+	for (unsigned int i = 0; i < HISTOGRAM_BUCKETS; i++)
+	{
+		seen += atomic_load_explicit(&h->counts[i], memory_order_relaxed);
+		if (seen >= target && seen > 0)
+			return (histogramBucketValue(i) < nSecMax) ? histogramBucketValue(i) : nSecMax;
+	}
+	return nSecMax;
+}
+
+void dumpMetrics(FILE *const out)
+{
+	fprintf(out, "%-14s %10s %10s %10s %10s %10s %10s %10s\n", "[us]", "samples", "mean", "p50", "p90", "p99", "p99.9", "max");
+	for (size_t i = 0; i < sizeof(metrics) / sizeof(metrics[0]); i++)
+	{
+		histogram const *const h = metrics[i];
+		unsigned long const samples = atomic_load_explicit(&h->samples, memory_order_relaxed);
+		if (!samples)
+		{
+			fprintf(out, "%-14s %10lu\n", h->name, samples);
+			continue;
+		}
+		fprintf(out, "%-14s %10lu %10.1f %10.1f %10.1f %10.1f %10.1f %10.1f\n", h->name, samples,
+				atomic_load_explicit(&h->nSecTotal, memory_order_relaxed) / 1e3 / samples,
+				histogramPercentile(h, samples, 50) / 1e3, histogramPercentile(h, samples, 90) / 1e3,
+				histogramPercentile(h, samples, 99) / 1e3, histogramPercentile(h, samples, 99.9) / 1e3,
+				atomic_load_explicit(&h->nSecMax, memory_order_relaxed) / 1e3);
+	}
+	fflush(out);
+}
+
+void requestMetricsDump(int signal)
+{
+	(void)signal;
+	metricsDumpRequested = 1;
+}
+
+// Activity of the game loop and the render thread per level, to compare the
+// adaptive tick scheduler with a loop that wakes up on every tick. Index 0
+// counts the time between games, index l + 1 level l, the last index all
+// levels from there on. The render thread only writes the renders.
+#define SCHEDULER_LEVELS 16
+
+typedef struct
+{
+	unsigned long long nSec; // time spent at the level
+	unsigned long ticks;	 // ticks played or skipped, the wakeups of a fixed tick
+	unsigned long wakeups;	 // ticks played
+	unsigned long renders;	 // frames rendered
+} levelActivity;
+
+levelActivity schedulerActivity[SCHEDULER_LEVELS];
+
+static inline levelActivity *activityOf(unsigned int const state, unsigned int const level)
+{
+	if (state == GAMEOVER)
+		return &schedulerActivity[0];
+	return &schedulerActivity[(level + 1 < SCHEDULER_LEVELS) ? level + 1 : SCHEDULER_LEVELS - 1];
+}
+
+void printSchedulerActivity(FILE *const out)
+{
+	unsigned long long nSec = 0;
+	unsigned long ticks = 0, wakeups = 0, renders = 0;
+	for (unsigned int i = 0; i < SCHEDULER_LEVELS; i++)
+	{
+		nSec += schedulerActivity[i].nSec;
+		ticks += schedulerActivity[i].ticks;
+		wakeups += schedulerActivity[i].wakeups;
+		renders += schedulerActivity[i].renders;
+	}
+	if (!ticks)
+		return;
+	fprintf(out, "scheduler: %lu wakeups and %lu renders for %lu ticks, %.1f%% of the wakeups of a fixed tick\n",
+			wakeups, renders, ticks, 100.0 * wakeups / ticks);
+	fprintf(out, "%6s %10s %10s %10s %10s\n", "level", "seconds", "ticks/s", "wakeups/s", "renders/s");
+	for (unsigned int i = 0; i < SCHEDULER_LEVELS; i++)
+	{
+		levelActivity const *const a = &schedulerActivity[i];
+		if (!a->nSec)
+			continue;
+		double const seconds = a->nSec / 1e9;
+		char level[8];
+		if (i == 0)
+			snprintf(level, sizeof(level), "over");
+		else
+			snprintf(level, sizeof(level), (i == SCHEDULER_LEVELS - 1) ? "%u+" : "%u", i - 1);
+		fprintf(out, "%6s %10.1f %10.1f %10.1f %10.1f\n", level, seconds, a->ticks / seconds, a->wakeups / seconds,
+				a->renders / seconds);
+	}
+}
+
+// The framebuffer and the joystick are normally the devices of the Sense HAT.
+// Either can be replaced by a virtual device, so that the render and input
+// paths run and can be profiled on machines without the hardware:
+// - a virtual framebuffer is a file of 8x8 RGB565 pixels mapped like the real
+//   one, another process can watch the LEDs by mapping or reading the same
+//   file. A file in /dev/shm keeps it in shared memory.
+// - a virtual joystick is a pipe (a FIFO is created if the path does not
+//   exist) that carries struct input_event records like the evdev device.
+//   Timestamps should be taken from CLOCK_MONOTONIC, events with a zero
+//   timestamp are stamped when they are read.
+#define FRAMEBUFFER_SIZE (8 * 8 * 2) // 8x8 pixels, 2 bytes per pixel
+
+static bool findSenseHatFramebuffer()
 {
-	bool fb = false; // Was filebuffer initialized?
-	bool js = false; // Was joystick initialized?
 	DIR *directory;
 	struct dirent *entry;
 
 	directory = opendir("/dev/");
-	if (directory)
+	if (!directory)
+		return false;
+	bool found = false;
+	char path[256];
+	while ((entry = readdir(directory)) != NULL)
 	{
-		char path[256];
-		while ((entry = readdir(directory)) != NULL)
+		snprintf(path, 256, "/dev/%s", entry->d_name);
+		fbfd = open(path, O_RDWR);
+		if (ioctl(fbfd, FBIOGET_FSCREENINFO, &fixed_screen_info) == -1) // If ioctl fails, close the file descriptor and continue
 		{
-			snprintf(path, 256, "/dev/%s", entry->d_name);
-			fbfd = open(path, O_RDWR);
-			if (ioctl(fbfd, FBIOGET_FSCREENINFO, &fixed_screen_info) == -1) // If ioctl fails, close the file descriptor and continue
-			{
-				close(fbfd);
-				continue;
-			}
-			if (strcmp(fixed_screen_info.id, "RPi-Sense FB") == 0) // Check that the framebuffer is the Sense HAT framebuffer
-			{
-				size_t fb_size = 8 * 8 * 2; // 8x8 pixels, 2 bytes per pixel
-				fbmapping = mmap(NULL, fb_size,
-								 PROT_READ | PROT_WRITE, MAP_SHARED, fbfd, (off_t)0);
-				fb = true;
-				break;
-			}
 			close(fbfd);
+			continue;
 		}
-		closedir(directory);
+		if (strcmp(fixed_screen_info.id, "RPi-Sense FB") == 0) // Check that the framebuffer is the Sense HAT framebuffer
+		{
+			fbmapping = mmap(NULL, FRAMEBUFFER_SIZE,
+							 PROT_READ | PROT_WRITE, MAP_SHARED, fbfd, (off_t)0);
+			found = fbmapping != MAP_FAILED;
+			break;
+		}
+		close(fbfd);
 	}
+	closedir(directory);
+	return found;
+}
+
+static bool findSenseHatJoystick()
+{
+	DIR *directory;
+	struct dirent *entry;
 
 	directory = opendir("/dev/input");
-	if (directory)
+	if (!directory)
+		return false;
+	bool found = false;
+	char path[256];
+	char devicename[256];
+	while ((entry = readdir(directory)) != NULL)
 	{
-		char path[256];
-		char devicename[256];
-		while ((entry = readdir(directory)) != NULL)
+		snprintf(path, 256, "/dev/input/%s", entry->d_name);
+		jsfd = open(path, O_RDONLY | O_NONBLOCK);						   // Open the joystick in non-blocking mode
+		if (ioctl(jsfd, EVIOCGNAME(sizeof(devicename)), devicename) == -1) // If ioctl fails, close the file descriptor and continue
 		{
-			snprintf(path, 256, "/dev/input/%s", entry->d_name);
-			jsfd = open(path, O_RDONLY | O_NONBLOCK);						   // Open the joystick in non-blocking mode
-			if (ioctl(jsfd, EVIOCGNAME(sizeof(devicename)), devicename) == -1) // If ioctl fails, close the file descriptor and continue
-			{
-				close(jsfd);
-				continue;
-			}
-			if (strcmp(devicename, "Raspberry Pi Sense HAT Joystick") == 0) // Check that the joystick is the Sense HAT joystick
-			{
-				js = true;
-				break;
-			}
 			close(jsfd);
+			continue;
+		}
+		if (strcmp(devicename, "Raspberry Pi Sense HAT Joystick") == 0) // Check that the joystick is the Sense HAT joystick
+		{
+			int clock = CLOCK_MONOTONIC; // Timestamp the events with the same clock as the game loop
+			jsMonotonic = ioctl(jsfd, EVIOCSCLOCKID, &clock) == 0;
+			found = true;
+			break;
 		}
-		closedir(directory);
+		close(jsfd);
+	}
+	closedir(directory);
+	return found;
+}
+
+static bool openVirtualFramebuffer(char const *const path)
+{
+	fbfd = open(path, O_RDWR | O_CREAT, 0644);
+	if (fbfd == -1)
+		return false;
+	if (ftruncate(fbfd, FRAMEBUFFER_SIZE) == -1)
+	{
+		close(fbfd);
+		return false;
+	}
+	fbmapping = mmap(NULL, FRAMEBUFFER_SIZE, PROT_READ | PROT_WRITE, MAP_SHARED, fbfd, (off_t)0);
+	if (fbmapping == MAP_FAILED)
+	{
+		close(fbfd);
+		return false;
 	}
+	memset(fbmapping, 0, FRAMEBUFFER_SIZE);
+	return true;
+}
+
+static bool openVirtualJoystick(char const *const path)
+{
+	if (mkfifo(path, 0644) == -1 && errno != EEXIST)
+		return false;
+	// Non-blocking, so that opening does not wait for a writer and reading an
+	// empty pipe returns at once. Opened for writing as well, so that the pipe
+	// never reports a hangup to poll() when a writer goes away.
+	jsfd = open(path, O_RDWR | O_NONBLOCK);
+	jsMonotonic = true;
+	return jsfd != -1;
+}
+
+// This function is called on the start of your application
+// Here you can initialize what ever you need for your task
+// return false if something fails, else true
+// A device path replaces the Sense HAT device by a virtual one, NULL looks
+// for the Sense HAT.
+bool initializeSenseHat(char const *const fbPath, char const *const jsPath)
+{
+	bool const fb = fbPath ? openVirtualFramebuffer(fbPath) : findSenseHatFramebuffer(); // Was filebuffer initialized?
+	if (!fb)
+		fprintf(stderr, "ERROR: could not open framebuffer %s\n", fbPath ? fbPath : "of the Sense HAT");
+	bool const js = jsPath ? openVirtualJoystick(jsPath) : findSenseHatJoystick(); // Was joystick initialized?
+	if (!js)
+		fprintf(stderr, "ERROR: could not open joystick %s\n", jsPath ? jsPath : "of the Sense HAT");
 
 	return fb && js; // Return false if either joystick or framebuffer was not initialized
 }
@@ -138,59 +448,87 @@ bool initializeSenseHat()
 // Here you can free up everything that you might have opened/allocated
 void freeSenseHat()
 {
-	memset(fbmapping, 0, 128);
-	munmap(fbmapping, 128);
+	memset(fbmapping, 0, FRAMEBUFFER_SIZE);
+	munmap(fbmapping, FRAMEBUFFER_SIZE);
 	close(fbfd);
 	close(jsfd);
 }
 
-// This function should return the key that corresponds to the joystick press
+// Is the key code one the game acts on? Other codes, e.g. of another evdev
+// device or written into the virtual joystick, are dropped: the recordings
+// store a key in a single byte and use 0 as end marker.
+static inline bool gameKey(unsigned int const code)
+{
+	return code == KEY_UP || code == KEY_DOWN || code == KEY_LEFT || code == KEY_RIGHT || code == KEY_ENTER;
+}
+
+// This function queues the keys that correspond to the joystick presses
 // KEY_UP, KEY_DOWN, KEY_LEFT, KEY_RIGHT, with the respective direction
-// and KEY_ENTER, when the the joystick is pressed
-// !!! when nothing was pressed you MUST return 0 !!!
-int readSenseHatJoystick()
+// and KEY_ENTER, when the the joystick is pressed. All pending events are
+// drained with as few reads as possible, the joystick is non-blocking.
+// The evdev device only returns whole events, a pipe may end a read in the
+// middle of one, its start is kept for the next read.
+void readSenseHatJoystick(inputQueue *const queue)
 {
-	struct input_event input;
-	struct pollfd poll_joystick = {// Create a pollfd struct for the joystick. POLLIN says we are interested in any new data
-								   .fd = jsfd,
-								   .events = POLLIN,
-								   .revents = 0};
+	static struct input_event input[INPUT_QUEUE_SIZE];
+	static size_t partial = 0; // bytes of an incomplete event at the start of input
+	size_t available;
 
-	if (poll(&poll_joystick, 1, 0) > 0) // If there is an event
+	do
 	{
-		read(jsfd, &input, sizeof(struct input_event));
-		if (input.type == EV_KEY && (input.value == 1 || input.value == 2)) // If the event is a key press or hold
+		ssize_t const bytes = read(jsfd, (char *)input + partial, sizeof(input) - partial);
+		if (bytes <= 0)
+			break;
+		available = partial + bytes;
+		size_t const events = available / sizeof(struct input_event);
+		for (size_t i = 0; i < events; i++)
 		{
-			return input.code; // Return the key code
+			if (input[i].type == EV_KEY && (input[i].value == 1 || input[i].value == 2) && gameKey(input[i].code)) // If the event is a key press or hold
+			{
+				bool const stamped = input[i].input_event_sec || input[i].input_event_usec;
+				unsigned long long const nSecTime = (jsMonotonic && stamped) ? (input[i].input_event_sec * 1000000000ull + input[i].input_event_usec * 1000ull)
+																			 : nSecNow();
+				pushInput(queue, input[i].code, nSecTime);
+			}
 		}
-	}
-
-	return 0;
+		partial = available % sizeof(struct input_event);
+		memmove(input, &input[events], partial);
+	} while (available == sizeof(input)); // a full buffer means there may be more
 }
 
-// This function should render the gamefield on the LED matrix. It is called
-// every game tick. The parameter playfieldChanged signals whether the game logic
-// has changed the playfield
-void renderSenseHatMatrix(bool const playfieldChanged)
+// The renderers only see immutable frame snapshots published by the game
+// loop, see publishFrame(). The console shows a view of at most
+// CONSOLE_VIEW_COLUMNS x CONSOLE_VIEW_ROWS tiles that follows the active
+// tile. The LED matrix shows the playfield itself when it fits on the 8x8
+// pixels, otherwise a downscaled image of it or an 8x8 view that follows the
+// active tile.
+#define CONSOLE_VIEW_COLUMNS 64
+#define CONSOLE_VIEW_ROWS 32
+#define MATRIX_SIZE 8
+
+typedef struct
 {
-	if (playfieldChanged)
-	{
-		memset(fbmapping, 0, 128); // Clear the screen
-	}
-	else
-	{
-		return; // If nothing changed we don't need to do anything
-	}
+	coord viewOrigin;							 // playfield tile at the top left of the console view
+	coord viewSize;								 // tiles in the console view
+	rowbits view[CONSOLE_VIEW_ROWS];			 // occupancy of the view, bit x is column viewOrigin.x + x
+	u_int16_t matrix[MATRIX_SIZE * MATRIX_SIZE]; // RGB565 image of the LED matrix
+	u_int64_t matrixDirty;						 // pixels changed since the previous frame, bit y * 8 + x
+	unsigned int tiles, rows, score, level, state;
+	unsigned long long nSecInput; // oldest key press shown first in this frame, 0 if none
+} frameSnapshot;
 
-	for (size_t i = 0; i < game.grid.y; i++) // row
+// This function renders a frame on the LED matrix. It is called by the render
+// thread for every frame it renders. Only the pixels that changed since the
+// previous frame are written, together with skippedDirty, the pixels of the
+// frames it took but did not render. There is no clear of the whole matrix.
+void renderSenseHatMatrix(frameSnapshot const *const frame, u_int64_t const skippedDirty)
+{
+	u_int64_t dirty = frame->matrixDirty | skippedDirty;
+	while (dirty)
 	{
-		for (size_t j = 0; j < game.grid.x; j++) // column
-		{
-			if (game.playfield[i][j].occupied)
-			{
-				fbmapping[i * 8 + j] = game.playfield[i][j].color; // Each row is 16 bytes long, while each column is 2 bytes long.
-			}
-		}
+		unsigned int const pixel = __builtin_ctzll(dirty);
+		dirty &= dirty - 1;
+		fbmapping[pixel] = frame->matrix[pixel]; // Each row is 16 bytes long, while each column is 2 bytes long.
 	}
 }
 
@@ -198,6 +536,31 @@ void renderSenseHatMatrix(bool const playfieldChanged)
 // if you choose to change the playfield or the tile structure, you might need to
 // adjust this game logic <> playfield interface
 
+// Stored row of playfield row y
+static inline unsigned int storedRow(unsigned int const y)
+{
+	unsigned int const row = game.rowBase + y;
+	return (row < game.grid.y) ? row : row - game.grid.y;
+}
+
+static inline rowbits *occupiedRow(unsigned int const y)
+{
+	return &game.occupied[storedRow(y) * game.words];
+}
+
+static inline u_int16_t *colorRow(unsigned int const y)
+{
+	return &game.colors[storedRow(y) * game.colorStride];
+}
+
+// Dirty bits of row y, also marks the row in dirtyRows
+static inline rowbits *dirtyRow(unsigned int const y)
+{
+	unsigned int const row = storedRow(y);
+	game.dirtyRows[row / ROWBITS] |= (rowbits)1 << (row % ROWBITS);
+	return &game.dirty[row * game.words];
+}
+
 static inline void newTile(coord const target)
 {
 	u_int16_t color;
@@ -228,54 +591,123 @@ static inline void newTile(coord const target)
 	default:
 		break;
 	}
-	game.playfield[target.y][target.x].occupied = true;
-	game.playfield[target.y][target.x].color = color;
+	occupiedRow(target.y)[target.x / ROWBITS] |= (rowbits)1 << (target.x % ROWBITS);
+	colorRow(target.y)[target.x] = color;
+	dirtyRow(target.y)[target.x / ROWBITS] |= (rowbits)1 << (target.x % ROWBITS);
 }
 
 static inline void copyTile(coord const to, coord const from)
 {
-	memcpy((void *)&game.playfield[to.y][to.x], (void *)&game.playfield[from.y][from.x], sizeof(tile));
+	rowbits const fromBit = (occupiedRow(from.y)[from.x / ROWBITS] >> (from.x % ROWBITS)) & 1;
+	rowbits *const toWord = &occupiedRow(to.y)[to.x / ROWBITS];
+	*toWord = (*toWord & ~((rowbits)1 << (to.x % ROWBITS))) | (fromBit << (to.x % ROWBITS));
+	colorRow(to.y)[to.x] = colorRow(from.y)[from.x];
+	dirtyRow(to.y)[to.x / ROWBITS] |= (rowbits)1 << (to.x % ROWBITS);
 }
 
 static inline void copyRow(unsigned int const to, unsigned int const from)
 {
-	memcpy((void *)&game.playfield[to][0], (void *)&game.playfield[from][0], sizeof(tile) * game.grid.x);
+	memcpy((void *)occupiedRow(to), (void *)occupiedRow(from), sizeof(rowbits) * game.words);
+	memcpy((void *)colorRow(to), (void *)colorRow(from), sizeof(u_int16_t) * game.grid.x);
+	memset((void *)dirtyRow(to), 0xff, sizeof(rowbits) * game.words);
+}
+
+// Moves the rows 0 to target - 1 down by one row, overwriting row target.
+// Rotating the ring moves the bottom row to the top in constant time, the
+// caller resets the new row 0.
+static inline void shiftRowsDown(unsigned int const target)
+{
+	if (target == game.grid.y - 1)
+	{
+		game.rowBase = (game.rowBase == 0) ? game.grid.y - 1 : game.rowBase - 1;
+		game.dirtyAll = true;
+		return;
+	}
+	for (unsigned int y = target; y > 0; y--)
+	{
+		copyRow(y, y - 1);
+	}
 }
 
 static inline void resetTile(coord const target)
 {
-	memset((void *)&game.playfield[target.y][target.x], 0, sizeof(tile));
+	occupiedRow(target.y)[target.x / ROWBITS] &= ~((rowbits)1 << (target.x % ROWBITS));
+	colorRow(target.y)[target.x] = 0;
+	dirtyRow(target.y)[target.x / ROWBITS] |= (rowbits)1 << (target.x % ROWBITS);
 }
 
 static inline void resetRow(unsigned int const target)
 {
-	memset((void *)&game.playfield[target][0], 0, sizeof(tile) * game.grid.x);
+	memset((void *)occupiedRow(target), 0, sizeof(rowbits) * game.words);
+	memset((void *)colorRow(target), 0, sizeof(u_int16_t) * game.grid.x);
+	memset((void *)dirtyRow(target), 0xff, sizeof(rowbits) * game.words);
 }
 
 static inline bool tileOccupied(coord const target)
 {
-	return game.playfield[target.y][target.x].occupied;
+	return (occupiedRow(target.y)[target.x / ROWBITS] >> (target.x % ROWBITS)) & 1;
 }
 
 static inline bool rowOccupied(unsigned int const target)
 {
-	for (unsigned int x = 0; x < game.grid.x; x++)
+	rowbits const *const row = occupiedRow(target);
+	for (unsigned int w = 0; w + 1 < game.words; w++)
 	{
-		coord const checkTile = {x, target};
-		if (!tileOccupied(checkTile))
-		{
+		if (~row[w])
 			return false;
-		}
 	}
-	return true;
+	return row[game.words - 1] == game.lastWordMask;
 }
 
 static inline void resetPlayfield()
 {
-	for (unsigned int y = 0; y < game.grid.y; y++)
+	memset((void *)game.occupied, 0, sizeof(rowbits) * game.words * game.grid.y);
+	memset((void *)game.colors, 0, sizeof(u_int16_t) * game.colorStride * game.grid.y);
+	game.rowBase = 0;
+	game.dirtyAll = true;
+}
+
+static void *allocateAligned(size_t const size)
+{
+	void *const memory = aligned_alloc(CACHE_LINE, (size + CACHE_LINE - 1) / CACHE_LINE * CACHE_LINE);
+	if (memory)
+		memset(memory, 0, size);
+	return memory;
+}
+
+void freePlayfield()
+{
+	free(game.occupied);
+	free(game.colors);
+	free(game.dirty);
+	free(game.dirtyRows);
+	game.occupied = NULL;
+	game.colors = NULL;
+	game.dirty = NULL;
+	game.dirtyRows = NULL;
+}
+
+// Allocates the playfield for the configured grid, returns false on failure
+bool allocatePlayfield()
+{
+	if (game.grid.x == 0 || game.grid.y == 0 || game.grid.x > GRID_MAX || game.grid.y > GRID_MAX)
+	{
+		return false;
+	}
+	game.words = (game.grid.x + ROWBITS - 1) / ROWBITS;
+	game.colorStride = (game.grid.x + CACHE_LINE / sizeof(u_int16_t) - 1) / (CACHE_LINE / sizeof(u_int16_t)) * (CACHE_LINE / sizeof(u_int16_t));
+	game.lastWordMask = (game.grid.x % ROWBITS) ? (((rowbits)1 << (game.grid.x % ROWBITS)) - 1) : ~(rowbits)0;
+	game.occupied = (rowbits *)allocateAligned(sizeof(rowbits) * game.words * game.grid.y);
+	game.colors = (u_int16_t *)allocateAligned(sizeof(u_int16_t) * game.colorStride * game.grid.y);
+	game.dirty = (rowbits *)allocateAligned(sizeof(rowbits) * game.words * game.grid.y);
+	game.dirtyRows = (rowbits *)allocateAligned(sizeof(rowbits) * ((game.grid.y + ROWBITS - 1) / ROWBITS));
+	game.rowBase = 0;
+	if (!game.occupied || !game.colors || !game.dirty || !game.dirtyRows)
 	{
-		resetRow(y);
+		freePlayfield();
+		return false;
 	}
+	return true;
 }
 
 // Below here comes the game logic. Keep in mind: You are not allowed to change how the game works!
@@ -335,10 +767,7 @@ bool clearRow()
 {
 	if (rowOccupied(game.grid.y - 1))
 	{
-		for (unsigned int y = game.grid.y - 1; y > 0; y--)
-		{
-			copyRow(y, y - 1);
-		}
+		shiftRowsDown(game.grid.y - 1);
 		resetRow(0);
 		return true;
 	}
@@ -459,119 +888,1747 @@ bool sTetris(int const key)
 	return playfieldChanged;
 }
 
-int readKeyboard()
+// Called once per tick after the game logic, the game state is calculated
+// again when the tick wraps back to zero
+void advanceTick()
 {
-	struct pollfd pollStdin = {
-		.fd = STDIN_FILENO,
-		.events = POLLIN};
-	int lkey = 0;
+	game.tick = (game.tick + 1) % game.nextGameTick;
+}
 
-	if (poll(&pollStdin, 1, 0))
-	{
-		lkey = fgetc(stdin);
-		if (lkey != 27)
-			goto exit;
-		lkey = fgetc(stdin);
-		if (lkey != 91)
-			goto exit;
-		lkey = fgetc(stdin);
-	}
-exit:
-	switch (lkey)
-	{
-	case 10:
-		return KEY_ENTER;
-	case 65:
-		return KEY_UP;
-	case 66:
-		return KEY_DOWN;
-	case 67:
-		return KEY_RIGHT;
-	case 68:
-		return KEY_LEFT;
-	}
-	return 0;
+// Applies a key press without calculating the next game state, even when
+// the tick is due. Keys that restart the tick (dropping the tile, starting
+// a new game) keep doing so and set tickReset.
+static bool applyKey(int const key, bool *const tickReset)
+{
+	unsigned long const tick = game.tick;
+	game.tick = 1; // any tick but 0 skips the game state update
+	bool const playfieldChanged = sTetris(key);
+	if (game.tick == 0)
+		*tickReset = true;
+	else
+		game.tick = tick;
+	return playfieldChanged;
 }
 
-void renderConsole(bool const playfieldChanged)
+// Plays one tick with all queued key presses in order. The game state is
+// advanced only once together with the last key, as it is with a single
+// press per tick. A press that restarts the tick has already advanced it,
+// then the presses after it only move the tile and the tick stays at 0.
+// Sets quit and stops when KEY_ENTER was pressed.
+bool playTick(inputQueue *const queue, bool *const quit)
 {
-	if (!playfieldChanged)
-		return;
+	bool playfieldChanged = false;
+	bool tickReset = false;
+	inputEvent event;
+	int key = 0;
 
-	// Goto beginning of console
-	fprintf(stdout, "\033[%d;%dH", 0, 0);
-	for (unsigned int x = 0; x < game.grid.x + 2; x++)
+	while (popInput(queue, &event))
 	{
-		fprintf(stdout, "-");
+		if (event.key == KEY_ENTER)
+		{
+			*quit = true;
+			return playfieldChanged;
+		}
+		if (key)
+			playfieldChanged |= applyKey(key, &tickReset);
+		key = event.key;
 	}
-	fprintf(stdout, "\n");
-	for (unsigned int y = 0; y < game.grid.y; y++)
+	if (tickReset)
+		return applyKey(key, &tickReset) || playfieldChanged;
+	return sTetris(key) || playfieldChanged;
+}
+
+bool keyboardOpen = true; // false once stdin reached its end, e.g. when redirected
+
+// Queues the keys of the console. Everything available is read at once,
+// an escape sequence split across two reads is continued on the next call.
+void readKeyboard(inputQueue *const queue)
+{
+	static int escape = 0; // bytes of the escape sequence "\033[" seen so far
+	struct pollfd pollStdin = {
+		.fd = STDIN_FILENO,
+		.events = POLLIN};
+	unsigned char buffer[64];
+
+	if (!keyboardOpen || poll(&pollStdin, 1, 0) <= 0)
+		return;
+	ssize_t const bytes = read(STDIN_FILENO, buffer, sizeof(buffer));
+	if (bytes == 0)
+		keyboardOpen = false;
+	unsigned long long const nSecTime = nSecNow();
+	for (ssize_t i = 0; i < bytes; i++)
 	{
-		fprintf(stdout, "|");
-		for (unsigned int x = 0; x < game.grid.x; x++)
+		int const lkey = buffer[i];
+		if ((escape == 0 && lkey == 27) || (escape == 1 && lkey == 91))
 		{
-			coord const checkTile = {x, y};
-			fprintf(stdout, "%c", (tileOccupied(checkTile)) ? '#' : ' ');
+			escape++;
+			continue;
 		}
-		switch (y)
+		escape = 0;
+		switch (lkey)
 		{
-		case 0:
-			fprintf(stdout, "| Tiles: %10u\n", game.tiles);
+		case 10:
+			pushInput(queue, KEY_ENTER, nSecTime);
 			break;
-		case 1:
-			fprintf(stdout, "| Rows:  %10u\n", game.rows);
+		case 65:
+			pushInput(queue, KEY_UP, nSecTime);
 			break;
-		case 2:
-			fprintf(stdout, "| Score: %10u\n", game.score);
+		case 66:
+			pushInput(queue, KEY_DOWN, nSecTime);
 			break;
-		case 4:
-			fprintf(stdout, "| Level: %10u\n", game.level);
+		case 67:
+			pushInput(queue, KEY_RIGHT, nSecTime);
 			break;
-		case 7:
-			fprintf(stdout, "| %17s\n", (game.state == GAMEOVER) ? "Game Over" : "");
+		case 68:
+			pushInput(queue, KEY_LEFT, nSecTime);
 			break;
-		default:
-			fprintf(stdout, "|\n");
 		}
 	}
-	for (unsigned int x = 0; x < game.grid.x + 2; x++)
+}
+
+// Adaptive tick scheduler. A tick without key presses and without a gravity
+// step leaves the game unchanged, so instead of waking up on every tick the
+// game loop sleeps until the due tick, the next one that changes the game by
+// itself, or until input arrives. The ticks in between are skipped, they
+// only advance the game tick. Input is played as the tick that would have
+// read it with a fixed tick, which is at most one tick early.
+// The ticks are scheduled from nSecOrigin, the start of tick 0. When the
+// loop wakes up more than a tick late, e.g. after the process was stopped,
+// the schedule is moved forward instead of catching up on the missed ticks.
+// Returns the next tick to play. nSecScheduled is set to its start on the
+// tick schedule, which a tick woken up by input may be ahead of, or to 0
+// without a tick delay.
+unsigned long waitForTick(unsigned long const tick, unsigned long const due, bool const waitForInput,
+						  unsigned long long *const nSecOrigin, unsigned long long *const nSecScheduled)
+{
+	unsigned long long const nSecTick = game.uSecTickTime * 1000ull;
+	unsigned long long const nSecDue = (due == ULONG_MAX) ? ULLONG_MAX : *nSecOrigin + due * nSecTick;
+	unsigned long next = due;
+
+	*nSecScheduled = 0;
+	if (nSecTick == 0)
+		return tick; // no tick delay, every tick is played at once
+
+	if (waitForInput)
 	{
-		fprintf(stdout, "-");
+		// Input that arrives before the tick ahead of this one waits for it
+		unsigned long long const nSecEarliest = *nSecOrigin + (tick - 1) * nSecTick;
+		if (nSecNow() < nSecEarliest && nSecEarliest < nSecDue)
+			sleepUntil(nSecEarliest);
+
+		struct pollfd devices[2] = {
+			{.fd = jsfd, .events = POLLIN},
+			{.fd = keyboardOpen ? STDIN_FILENO : -1, .events = POLLIN},
+		};
+		unsigned long long const nSecLeft = (nSecDue > nSecNow()) ? nSecDue - nSecNow() : 0;
+		struct timespec const timeout = {nSecLeft / 1000000000ull, nSecLeft % 1000000000ull};
+		if (ppoll(devices, 2, (due == ULONG_MAX) ? NULL : &timeout, NULL) != 0) // input or a signal
+		{
+			unsigned long const current = (nSecNow() - *nSecOrigin) / nSecTick;
+			next = (current + 1 < tick) ? tick : (current + 1 < due) ? current + 1 : due;
+		}
 	}
-	fflush(stdout);
+	else
+		sleepUntil(nSecDue);
+
+	unsigned long long const nSecWake = nSecNow();
+	if (nSecWake > *nSecOrigin + (next + 1) * nSecTick)
+		*nSecOrigin = nSecWake - next * nSecTick;
+	*nSecScheduled = *nSecOrigin + next * nSecTick;
+	game.tick = (game.tick + (next - tick)) % game.nextGameTick;
+	return next;
 }
 
-inline unsigned long uSecFromTimespec(struct timespec const ts)
+// The console renderer remembers the last frame it has drawn and only emits
+// cursor positioning escapes plus the content of the cells and stats that
+// changed since. Every frame is assembled in one buffer and written to the
+// terminal with a single write().
+typedef struct
 {
-	return ((ts.tv_sec * 1000000) + (ts.tv_nsec / 1000));
+	coord size;		 // tiles of the console view
+	char *cells;	 // cells of the last drawn frame, size.x per row
+	char *buffer;	 // output of the frame being assembled
+	size_t capacity; // size of the output buffer
+	size_t length;	 // bytes in the output buffer
+	bool drawn;		 // has the complete frame been drawn once?
+	unsigned int tiles, rows, score, level;
+	bool gameOver;
+
+	unsigned long frames;		   // frames written to the terminal
+	unsigned long long bytes;	   // bytes written to the terminal
+	unsigned long long nSecTotal; // time spent assembling and writing frames
+} consoleRenderer;
+
+consoleRenderer console;
+
+bool initializeConsole(coord const size)
+{
+	// Worst case is a cursor escape in front of every cell plus all stats lines
+	console.size = size;
+	console.capacity = size.x * size.y * 16 + (size.y + 2) * (size.x + 64) + 64;
+	console.cells = (char *)malloc(size.x * size.y);
+	console.buffer = (char *)malloc(console.capacity);
+	console.drawn = false;
+	return console.cells && console.buffer;
 }
 
-int main(int argc, char **argv)
+// Prints the renderer statistics below the playfield and frees its memory
+void freeConsole()
 {
-	(void)argc;
-	(void)argv;
-	// This sets the stdin in a special state where each
-	// keyboard press is directly flushed to the stdin and additionally
-	// not outputted to the stdout
+	fprintf(stdout, "\033[%u;1H\n", console.size.y + 2);
+	if (console.frames)
 	{
-		struct termios ttystate;
-		tcgetattr(STDIN_FILENO, &ttystate);
-		ttystate.c_lflag &= ~(ICANON | ECHO);
-		ttystate.c_cc[VMIN] = 1;
-		tcsetattr(STDIN_FILENO, TCSANOW, &ttystate);
+		fprintf(stdout, "console: %lu frames, %.1f bytes/frame, %.2f us/frame\n", console.frames,
+				(double)console.bytes / console.frames, console.nSecTotal / 1e3 / console.frames);
 	}
+	fflush(stdout);
+	free(console.cells);
+	free(console.buffer);
+}
+
+static inline void consoleAppend(char const c)
+{
+	console.buffer[console.length++] = c;
+}
+
+static void consolePrintf(char const *const format, ...)
+{
+	va_list arguments;
+	va_start(arguments, format);
+	int const written = vsnprintf(console.buffer + console.length, console.capacity - console.length, format, arguments);
+	va_end(arguments);
+	if (written > 0)
+		console.length += written;
+}
+
+// Moves the cursor to the 1-based terminal row and column
+static inline void consoleGoto(unsigned int const row, unsigned int const column)
+{
+	consolePrintf("\033[%u;%uH", row, column);
+}
+
+static void consoleStat(unsigned int const y, char const *const label, unsigned int *const shown, unsigned int const value)
+{
+	if (console.drawn && *shown == value)
+		return;
+	*shown = value;
+	if (y < console.size.y)
+	{
+		consoleGoto(y + 2, console.size.x + 3);
+		consolePrintf(" %s %10u", label, value);
+	}
+}
+
+void renderConsole(frameSnapshot const *const frame)
+{
+	struct timespec start, end;
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	console.length = 0;
+
+	if (!console.drawn)
+	{
+		// Clear the console and draw the borders once
+		consolePrintf("\033[H\033[J");
+		for (unsigned int x = 0; x < console.size.x + 2; x++)
+			consoleAppend('-');
+		for (unsigned int y = 0; y < console.size.y; y++)
+		{
+			consoleGoto(y + 2, 1);
+			consoleAppend('|');
+			consoleGoto(y + 2, console.size.x + 2);
+			consoleAppend('|');
+		}
+		consoleGoto(console.size.y + 2, 1);
+		for (unsigned int x = 0; x < console.size.x + 2; x++)
+			consoleAppend('-');
+	}
+
+	for (unsigned int y = 0; y < console.size.y; y++)
+	{
+		char *const shown = &console.cells[y * console.size.x];
+		bool cursorPlaced = false; // is the cursor right behind the last written cell?
+		for (unsigned int x = 0; x < console.size.x; x++)
+		{
+			char const cell = ((frame->view[y] >> x) & 1) ? '#' : ' ';
+			if (console.drawn && shown[x] == cell)
+			{
+				cursorPlaced = false;
+				continue;
+			}
+			if (!cursorPlaced)
+				consoleGoto(y + 2, x + 2);
+			consoleAppend(cell);
+			shown[x] = cell;
+			cursorPlaced = true;
+		}
+	}
+
+	consoleStat(0, "Tiles:", &console.tiles, frame->tiles);
+	consoleStat(1, "Rows: ", &console.rows, frame->rows);
+	consoleStat(2, "Score:", &console.score, frame->score);
+	consoleStat(4, "Level:", &console.level, frame->level);
+	bool const gameOver = (frame->state == GAMEOVER);
+	if ((!console.drawn || console.gameOver != gameOver) && console.size.y > 7)
+	{
+		consoleGoto(7 + 2, console.size.x + 3);
+		consolePrintf(" %17s", gameOver ? "Game Over" : "");
+	}
+	console.gameOver = gameOver;
+	console.drawn = true;
+
+	// Leave the cursor below the playfield, where the old renderer left it
+	consoleGoto(console.size.y + 2, console.size.x + 3);
+	char const *data = console.buffer;
+	size_t remaining = console.length;
+	while (remaining)
+	{
+		ssize_t const written = write(STDOUT_FILENO, data, remaining);
+		if (written < 0)
+		{
+			if (errno == EINTR)
+				continue;
+			break;
+		}
+		data += written;
+		remaining -= written;
+	}
+
+	clock_gettime(CLOCK_MONOTONIC, &end);
+	console.frames++;
+	console.bytes += console.length;
+	console.nSecTotal += nSecFromTimespec(end) - nSecFromTimespec(start);
+}
+
+// Rendering runs in its own thread so that a slow terminal cannot stretch
+// the game tick. After every tick that changed the playfield the game loop
+// publishes an immutable snapshot of the playfield and the stats through a
+// lock-free triple buffer: it fills the back slot and swaps it with the
+// middle slot, the render thread swaps the middle slot with its front slot
+// whenever a new frame is waiting there. Frames the render thread was too
+// slow for are skipped, their dirty pixels are carried over to the next one.
+#define FRAME_FRESH 4 // set in the middle index until the render thread took the frame
+
+typedef struct
+{
+	frameSnapshot slots[3];
+	atomic_uint middle; // slot last published, plus FRAME_FRESH
+	unsigned int back;	// slot owned by the game loop
+	unsigned int front; // slot owned by the render thread
+	sem_t published;	// posted for every published frame
+	atomic_bool quit;
+	pthread_t thread;
+} frameExchange;
+
+frameExchange frames;
+
+typedef enum
+{
+	MATRIX_SCALED,	 // every pixel shows a block of tiles
+	MATRIX_VIEWPORT, // the pixels show an 8x8 view following the active tile
+} matrixMode;
+
+typedef struct
+{
+	coord origin;
+	coord size;
+} viewport;
+
+// Owned by the game loop, describe what the published frames show
+viewport consoleView;
+viewport matrixView;
+matrixMode matrixDisplay = MATRIX_SCALED;
+u_int16_t matrixShown[MATRIX_SIZE * MATRIX_SIZE];	  // matrix image of the last published frame
+unsigned int matrixSource[MATRIX_SIZE * MATRIX_SIZE]; // row a scaled pixel shows, past its block if empty
+
+bool initializeFrames()
+{
+	consoleView.size.x = (game.grid.x < CONSOLE_VIEW_COLUMNS) ? game.grid.x : CONSOLE_VIEW_COLUMNS;
+	consoleView.size.y = (game.grid.y < CONSOLE_VIEW_ROWS) ? game.grid.y : CONSOLE_VIEW_ROWS;
+	matrixView.size.x = (game.grid.x < MATRIX_SIZE) ? game.grid.x : MATRIX_SIZE;
+	matrixView.size.y = (game.grid.y < MATRIX_SIZE) ? game.grid.y : MATRIX_SIZE;
+	atomic_init(&frames.middle, 1);
+	frames.back = 0;
+	frames.front = 2;
+	atomic_init(&frames.quit, false);
+	return sem_init(&frames.published, 0, 0) == 0;
+}
+
+void freeFrames()
+{
+	sem_destroy(&frames.published);
+}
+
+// Scrolls the view the least possible to have the active tile inside
+static void followActiveTile(viewport *const view)
+{
+	if (game.activeTile.x < view->origin.x)
+		view->origin.x = game.activeTile.x;
+	else if (game.activeTile.x >= view->origin.x + view->size.x)
+		view->origin.x = game.activeTile.x - view->size.x + 1;
+	if (game.activeTile.y < view->origin.y)
+		view->origin.y = game.activeTile.y;
+	else if (game.activeTile.y >= view->origin.y + view->size.y)
+		view->origin.y = game.activeTile.y - view->size.y + 1;
+}
+
+// Occupancy of width <= ROWBITS tiles of a row, starting at column x
+static rowbits extractTiles(rowbits const *const row, unsigned int const x, unsigned int const width)
+{
+	unsigned int const word = x / ROWBITS;
+	unsigned int const shift = x % ROWBITS;
+	rowbits tiles = row[word] >> shift;
+	if (shift && word + 1 < game.words)
+		tiles |= row[word + 1] << (ROWBITS - shift);
+	return (width == ROWBITS) ? tiles : tiles & (((rowbits)1 << width) - 1);
+}
+
+// First occupied column of a row in [from, to), to if there is none
+static unsigned int firstOccupied(rowbits const *const row, unsigned int const from, unsigned int const to)
+{
+	for (unsigned int x = from; x < to; x = (x / ROWBITS + 1) * ROWBITS)
+	{
+		rowbits const tiles = row[x / ROWBITS] >> (x % ROWBITS);
+		if (tiles)
+		{
+			unsigned int const found = x + __builtin_ctzll(tiles);
+			return (found < to) ? found : to;
+		}
+	}
+	return to;
+}
+
+// Clears the dirty tiles of every marked row and returns the pixels of the
+// scaled image whose blocks contain any of them, firstDirty is set to the
+// first dirty row of each of these blocks. Only the marked rows are visited,
+// so this takes time in the number of changed rows, not the grid.
+static u_int64_t takeDirtyBlocks(unsigned int const blockWidth, unsigned int const blockHeight, unsigned int const columns,
+								 unsigned int *const firstDirty)
+{
+	u_int64_t pixels = 0;
+	for (unsigned int w = 0; w < (game.grid.y + ROWBITS - 1) / ROWBITS; w++)
+	{
+		rowbits rows = game.dirtyRows[w];
+		game.dirtyRows[w] = 0;
+		while (rows)
+		{
+			unsigned int const row = w * ROWBITS + __builtin_ctzll(rows);
+			rows &= rows - 1;
+			rowbits *const dirty = &game.dirty[row * game.words];
+			unsigned int const y = (row >= game.rowBase) ? row - game.rowBase : row + game.grid.y - game.rowBase;
+			for (unsigned int px = 0; px < columns; px++)
+			{
+				unsigned int const pixel = y / blockHeight * MATRIX_SIZE + px;
+				unsigned int const to = ((px + 1) * blockWidth < game.grid.x) ? (px + 1) * blockWidth : game.grid.x;
+				if (firstOccupied(dirty, px * blockWidth, to) < to)
+				{
+					if (!(pixels & ((u_int64_t)1 << pixel)) || y < firstDirty[pixel])
+						firstDirty[pixel] = y;
+					pixels |= (u_int64_t)1 << pixel;
+				}
+			}
+			memset((void *)dirty, 0, sizeof(rowbits) * game.words);
+		}
+	}
+	return pixels;
+}
+
+// Finds the first occupied tile of a block, starting at row from, and shows
+// it in the pixel of the block. The rows of the block above from are empty.
+static void scanBlock(u_int16_t *const image, unsigned int const pixel, unsigned int const from,
+					  unsigned int const blockWidth, unsigned int const blockHeight)
+{
+	unsigned int const left = pixel % MATRIX_SIZE * blockWidth;
+	unsigned int const to = (left + blockWidth < game.grid.x) ? left + blockWidth : game.grid.x;
+	unsigned int const bottom = (pixel / MATRIX_SIZE + 1) * blockHeight;
+	unsigned int y = from;
+	for (; y < bottom && y < game.grid.y; y++)
+	{
+		unsigned int const x = firstOccupied(occupiedRow(y), left, to);
+		if (x < to)
+		{
+			image[pixel] = colorRow(y)[x];
+			matrixSource[pixel] = y;
+			return;
+		}
+	}
+	image[pixel] = 0;
+	matrixSource[pixel] = y;
+}
+
+// Fills the matrix image of the frame and marks the pixels that changed
+static void buildMatrix(frameSnapshot *const frame)
+{
+	u_int16_t *const image = frame->matrix;
+
+	if (game.grid.x <= MATRIX_SIZE && game.grid.y <= MATRIX_SIZE)
+	{
+		// The playfield fits, the dirty tiles are the dirty pixels
+		memset((void *)image, 0, sizeof(frame->matrix));
+		frame->matrixDirty = game.dirtyAll ? ~(u_int64_t)0 : 0;
+		for (unsigned int y = 0; y < game.grid.y; y++)
+		{
+			memcpy((void *)&image[y * MATRIX_SIZE], (void *)colorRow(y), sizeof(u_int16_t) * game.grid.x);
+			frame->matrixDirty |= (game.dirty[storedRow(y) * game.words] & 0xff) << (y * MATRIX_SIZE);
+		}
+		memset((void *)game.dirty, 0, sizeof(rowbits) * game.words * game.grid.y);
+		game.dirtyRows[0] = 0;
+		game.dirtyAll = false;
+		return;
+	}
+
+	// Every pixel of the scaled image shows the color of the first occupied
+	// tile of its block. A block is only scanned again from its first dirty
+	// row when that row is not below the row its pixel shows, the rows above
+	// are unchanged and empty. The whole image is scanned again when every
+	// tile changed (a new game, the ring rotated by a row clear).
+	unsigned int const blockWidth = (game.grid.x + MATRIX_SIZE - 1) / MATRIX_SIZE;
+	unsigned int const blockHeight = (game.grid.y + MATRIX_SIZE - 1) / MATRIX_SIZE;
+	unsigned int const columns = (game.grid.x + blockWidth - 1) / blockWidth;
+	unsigned int const rows = (game.grid.y + blockHeight - 1) / blockHeight;
+	unsigned int firstDirty[MATRIX_SIZE * MATRIX_SIZE];
+	u_int64_t stale = takeDirtyBlocks(blockWidth, blockHeight, columns, firstDirty);
+
+	if (matrixDisplay == MATRIX_VIEWPORT)
+	{
+		memset((void *)image, 0, sizeof(frame->matrix));
+		followActiveTile(&matrixView);
+		for (unsigned int y = 0; y < matrixView.size.y; y++)
+		{
+			memcpy((void *)&image[y * MATRIX_SIZE], (void *)&colorRow(matrixView.origin.y + y)[matrixView.origin.x],
+				   sizeof(u_int16_t) * matrixView.size.x);
+		}
+	}
+	else
+	{
+		memcpy((void *)image, (void *)matrixShown, sizeof(frame->matrix));
+		if (game.dirtyAll)
+		{
+			for (unsigned int py = 0; py < rows; py++)
+			{
+				for (unsigned int px = 0; px < columns; px++)
+				{
+					scanBlock(image, py * MATRIX_SIZE + px, py * blockHeight, blockWidth, blockHeight);
+				}
+			}
+			stale = 0;
+		}
+		while (stale)
+		{
+			unsigned int const pixel = __builtin_ctzll(stale);
+			stale &= stale - 1;
+			if (firstDirty[pixel] <= matrixSource[pixel])
+				scanBlock(image, pixel, firstDirty[pixel], blockWidth, blockHeight);
+		}
+	}
+
+	// Changes of the scaled or moving image are found by comparing with the last one
+	frame->matrixDirty = game.dirtyAll ? ~(u_int64_t)0 : 0;
+	game.dirtyAll = false;
+	for (unsigned int i = 0; i < MATRIX_SIZE * MATRIX_SIZE; i++)
+	{
+		if (image[i] != matrixShown[i])
+			frame->matrixDirty |= (u_int64_t)1 << i;
+	}
+	memcpy((void *)matrixShown, (void *)image, sizeof(matrixShown));
+}
+
+// Called by the game loop, hands the current playfield to the render thread.
+// nSecInput is the time of the oldest key press that changed this frame.
+void publishFrame(unsigned long long const nSecInput)
+{
+	frameSnapshot *const back = &frames.slots[frames.back];
+	followActiveTile(&consoleView);
+	back->viewOrigin = consoleView.origin;
+	back->viewSize = consoleView.size;
+	for (unsigned int y = 0; y < consoleView.size.y; y++)
+	{
+		back->view[y] = extractTiles(occupiedRow(consoleView.origin.y + y), consoleView.origin.x, consoleView.size.x);
+	}
+	buildMatrix(back);
+	back->tiles = game.tiles;
+	back->rows = game.rows;
+	back->score = game.score;
+	back->level = game.level;
+	back->state = game.state;
+	back->nSecInput = nSecInput;
+
+	// The swap below drops a frame the render thread has not taken yet, so
+	// its dirty pixels go into this one. If the render thread takes it in the
+	// meantime, the extra dirty pixels only cause some redundant writes.
+	unsigned int const middle = atomic_load_explicit(&frames.middle, memory_order_acquire);
+	if (middle & FRAME_FRESH)
+	{
+		back->matrixDirty |= frames.slots[middle & 3].matrixDirty;
+		unsigned long long const skippedInput = frames.slots[middle & 3].nSecInput;
+		if (skippedInput && (!back->nSecInput || skippedInput < back->nSecInput))
+			back->nSecInput = skippedInput;
+	}
+
+	frames.back = atomic_exchange_explicit(&frames.middle, frames.back | FRAME_FRESH, memory_order_acq_rel) & 3;
+	sem_post(&frames.published);
+}
+
+// Frames published within one refresh of the displays are coalesced, the
+// render thread holds a frame until the next refresh and renders the last
+// one published until then. A frame that shows a key press is rendered at
+// once, so only the gravity steps and replays without input are coalesced.
+#define DISPLAY_REFRESH_HZ 60
+
+void *renderThreadMain(void *arg)
+{
+	(void)arg;
+	unsigned long long nSecNextRender = 0;
+	frameSnapshot const *frame = NULL; // taken but not rendered yet
+	u_int64_t skippedDirty = 0;		   // pixels changed in frames replaced before they were rendered
+	while (true)
+	{
+		if (frame)
+		{
+			struct timespec const refresh = {nSecNextRender / 1000000000ull, nSecNextRender % 1000000000ull};
+			if (sem_clockwait(&frames.published, CLOCK_MONOTONIC, &refresh) == -1 && errno == EINTR)
+				continue;
+		}
+		else if (sem_wait(&frames.published) == -1)
+			continue; // EINTR
+		bool const quit = atomic_load_explicit(&frames.quit, memory_order_acquire);
+		if (atomic_load_explicit(&frames.middle, memory_order_relaxed) & FRAME_FRESH)
+		{
+			// The game loop may still read the slot it published, so the dirty
+			// pixels of a replaced frame are kept here instead of merged into it
+			if (frame)
+				skippedDirty |= frame->matrixDirty;
+			frames.front = atomic_exchange_explicit(&frames.middle, frames.front, memory_order_acq_rel) & 3;
+			frame = &frames.slots[frames.front];
+		}
+		if (frame && (quit || frame->nSecInput || nSecNow() >= nSecNextRender))
+		{
+			nSecNextRender = nSecNow() + 1000000000ull / DISPLAY_REFRESH_HZ;
+			activityOf(frame->state, frame->level)->renders++;
+			if (metricsEnabled)
+			{
+				unsigned long long const nSecStart = nSecNow();
+				renderConsole(frame);
+				renderSenseHatMatrix(frame, skippedDirty);
+				unsigned long long const nSecEnd = nSecNow();
+				recordHistogram(&renderTime, nSecEnd - nSecStart);
+				if (frame->nSecInput && frame->nSecInput <= nSecEnd)
+					recordHistogram(&inputLatency, nSecEnd - frame->nSecInput);
+			}
+			else
+			{
+				renderConsole(frame);
+				renderSenseHatMatrix(frame, skippedDirty);
+			}
+			frame = NULL;
+			skippedDirty = 0;
+		}
+		if (quit)
+			break; // the last frame was published before quit was set
+	}
+	return NULL;
+}
+
+bool startRenderThread()
+{
+	return pthread_create(&frames.thread, NULL, renderThreadMain, NULL) == 0;
+}
+
+// Renders the last published frame and waits for the render thread to end
+void stopRenderThread()
+{
+	atomic_store_explicit(&frames.quit, true, memory_order_release);
+	sem_post(&frames.published);
+	pthread_join(frames.thread, NULL);
+}
+
+// Input recordings store the key presses of a run as (tick, key) pairs, so
+// that the run can be replayed tick exact. The file starts with
+// RECORDING_MAGIC followed by one record per key press: the ticks since the
+// previous record as LEB128 varint and the key code as a single byte. A
+// record with key 0 marks the last tick of the run.
+#define RECORDING_MAGIC "STR1"
+
+typedef struct
+{
+	FILE *file;
+	bool writing;
+	unsigned long tick; // tick of the last record written or read
+	bool pending;		// replay: a record was read but not yet queued
+	int key;			// replay: key of the pending record
+} inputRecording;
+
+// Reads the next record. Returns false at the end of the recording and on a
+// bad record: a varint that does not fit 64 bits or moves the tick past the
+// largest one, as only a corrupt file would have.
+static bool readRecord(inputRecording *const r)
+{
+	unsigned long delta = 0;
+	int byte;
+	for (unsigned int shift = 0; (byte = fgetc(r->file)) != EOF; shift += 7)
+	{
+		if (shift >= 64 || (shift == 63 && (byte & 0x7e)))
+		{
+			fprintf(stderr, "ERROR: bad tick delta in the recording, replaying up to tick %lu\n", r->tick);
+			return false;
+		}
+		delta |= (unsigned long)(byte & 0x7f) << shift;
+		if (!(byte & 0x80))
+			break;
+	}
+	if (byte == EOF || (r->key = fgetc(r->file)) == EOF)
+		return false;
+	if (delta > ULONG_MAX - r->tick)
+	{
+		fprintf(stderr, "ERROR: bad tick delta in the recording, replaying up to tick %lu\n", r->tick);
+		return false;
+	}
+	r->tick += delta;
+	return true;
+}
+
+bool openRecording(inputRecording *const r, char const *const path, bool const write)
+{
+	char magic[sizeof(RECORDING_MAGIC) - 1];
+	*r = (inputRecording){0};
+	r->file = fopen(path, write ? "wb" : "rb");
+	if (!r->file)
+		return false;
+	r->writing = write;
+	if (write)
+		return fwrite(RECORDING_MAGIC, sizeof(magic), 1, r->file) == 1;
+	if (fread(magic, sizeof(magic), 1, r->file) != 1 || memcmp(magic, RECORDING_MAGIC, sizeof(magic)) != 0)
+		return false;
+	r->pending = readRecord(r);
+	return true;
+}
+
+void recordKey(inputRecording *const r, unsigned long const tick, int const key)
+{
+	unsigned long delta = tick - r->tick;
+	r->tick = tick;
+	while (delta >= 0x80)
+	{
+		fputc((delta & 0x7f) | 0x80, r->file);
+		delta >>= 7;
+	}
+	fputc(delta, r->file);
+	fputc(key, r->file);
+}
+
+// Records all key presses waiting in the queue for this tick
+void recordQueue(inputRecording *const r, unsigned long const tick, inputQueue const *const queue)
+{
+	for (unsigned int i = queue->head; i != queue->tail; i++)
+	{
+		recordKey(r, tick, queue->events[i % INPUT_QUEUE_SIZE].key);
+	}
+}
+
+// Marks the tick as the last one of the run and closes the recording
+void closeRecording(inputRecording *const r, unsigned long const tick)
+{
+	if (!r->file)
+		return;
+	if (r->writing)
+		recordKey(r, tick, 0);
+	fclose(r->file);
+	r->file = NULL;
+}
+
+// Queues the keys recorded for the tick. Returns false when this was the
+// last tick of the recording.
+bool replayTick(inputRecording *const r, unsigned long const tick, inputQueue *const queue)
+{
+	while (r->pending && r->tick == tick)
+	{
+		if (r->key == 0)
+			return false; // end marker
+		pushInput(queue, r->key, nSecNow());
+		r->pending = readRecord(r);
+	}
+	return r->pending; // a truncated recording ends here as well
+}
+
+// FNV-1a hash over the complete game state, equal checksums after a replay
+// mean the replay behaved exactly like the recorded run
+u_int64_t stateChecksum()
+{
+	u_int64_t hash = 0xcbf29ce484222325ull;
+#define HASH_VALUE(value)                                             \
+	do                                                                \
+	{                                                                 \
+		unsigned char const *const bytes = (unsigned char const *)&(value); \
+		for (size_t i = 0; i < sizeof(value); i++)                    \
+			hash = (hash ^ bytes[i]) * 0x100000001b3ull;              \
+	} while (0)
+	for (unsigned int y = 0; y < game.grid.y; y++)
+	{
+		for (unsigned int w = 0; w < game.words; w++)
+			HASH_VALUE(occupiedRow(y)[w]);
+		for (unsigned int x = 0; x < game.grid.x; x++)
+			HASH_VALUE(colorRow(y)[x]);
+	}
+	HASH_VALUE(game.tiles);
+	HASH_VALUE(game.rows);
+	HASH_VALUE(game.score);
+	HASH_VALUE(game.level);
+	HASH_VALUE(game.state);
+	HASH_VALUE(game.activeTile);
+	HASH_VALUE(game.tick);
+	HASH_VALUE(game.nextGameTick);
+#undef HASH_VALUE
+	return hash;
+}
+
+// Replays a recording as fast as possible, without any devices
+void runReplay(inputRecording *const replay)
+{
+	inputQueue input = {0};
+	unsigned long tick = 0;
+	struct timespec start, end;
+
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	for (;; tick++)
+	{
+		bool quit = false;
+		bool const more = replayTick(replay, tick, &input);
+		playTick(&input, &quit);
+		if (quit)
+			break;
+		advanceTick();
+		if (!more)
+			break;
+	}
+	clock_gettime(CLOCK_MONOTONIC, &end);
+
+	double const nSecTotal = (double)(nSecFromTimespec(end) - nSecFromTimespec(start));
+	fprintf(stdout, "replay: %lu ticks in %.3f s, %.0f ticks/s, %.1f ns/tick\n", tick + 1, nSecTotal / 1e9,
+			(tick + 1) / (nSecTotal / 1e9), nSecTotal / (tick + 1));
+	fprintf(stdout, "state checksum after %lu ticks: %016llx\n", tick + 1, (unsigned long long)stateChecksum());
+}
+
+// Headless simulation: sTetris() is stepped as fast as possible without
+// any devices. Input comes from an input source which hands out the key
+// pressed in the current tick, 0 if nothing was pressed.
+typedef struct
+{
+	char const *name;
+	int (*nextKey)(void);
+} inputSource;
+
+_Thread_local u_int64_t rngState = 1; // xorshift64 state of the random input source
+
+char *scriptKeys;						 // keys of the input script, one per tick
+size_t scriptLength;					 // number of ticks in the input script
+_Thread_local size_t scriptPosition = 0; // next tick of the script to play
+
+static inline u_int64_t nextRandom()
+{
+	rngState ^= rngState << 13;
+	rngState ^= rngState >> 7;
+	rngState ^= rngState << 17;
+	return rngState;
+}
+
+void seedRandom(u_int64_t const seed)
+{
+	// xorshift must never be seeded with 0, mix the seed to spread small values
+	rngState = (seed * 0x9E3779B97F4A7C15ull) | 1;
+}
+
+// Presses a key in about every 6th tick. Each KEY_DOWN resets the game tick,
+// so dropping too often would keep the game from ever adding a new tile.
+int randomKey()
+{
+	u_int64_t const r = nextRandom() % 32;
+	if (r < 2)
+		return KEY_LEFT;
+	if (r < 4)
+		return KEY_RIGHT;
+	if (r < 5)
+		return KEY_DOWN;
+	return 0;
+}
+
+int scriptKey()
+{
+	int const key = scriptKeys[scriptPosition];
+	scriptPosition = (scriptPosition + 1) % scriptLength; // the script loops
+	return key;
+}
+
+// Drops the active tile into the reachable column with the lowest stack,
+// preferring the closest column on ties. Starts a new game when over.
+int greedyKey()
+{
+	if (game.state == GAMEOVER)
+		return KEY_UP;
+	if (!tileOccupied(game.activeTile))
+		return 0;
+
+	unsigned int const y = game.activeTile.y;
+	unsigned int target = game.activeTile.x;
+	unsigned int targetDepth = 0;
+	for (int direction = -1; direction <= 1; direction += 2)
+	{
+		for (int x = game.activeTile.x; x >= 0 && x < (int)game.grid.x; x += direction)
+		{
+			if (x != (int)game.activeTile.x && tileOccupied((coord){x, y}))
+				break; // the tile cannot pass this column
+			unsigned int depth = 0;
+			while (y + depth + 1 < game.grid.y && !tileOccupied((coord){x, y + depth + 1}))
+				depth++;
+			if (depth > targetDepth ||
+				(depth == targetDepth && abs(x - (int)game.activeTile.x) < abs((int)target - (int)game.activeTile.x)))
+			{
+				target = x;
+				targetDepth = depth;
+			}
+		}
+	}
+
+	if (target < game.activeTile.x)
+		return KEY_LEFT;
+	if (target > game.activeTile.x)
+		return KEY_RIGHT;
+	return KEY_DOWN;
+}
+
+// Lookahead autoplayer: plans the column of every new tile with a search
+// over the drops of the next LOOKAHEAD_DEPTH tiles. Tiles are single cells,
+// so a drop is fully described by its column. The search works on a copy of
+// the playfield packed into one 64 bit word, bit y * grid.x + x, and is only
+// used for playfields of up to 64 tiles, larger ones fall back to greedyKey().
+//
+// A column is only a candidate if the tile can reach it before gravity
+// lands it, at one move per tick. Only the LOOKAHEAD_BEAM drops of a board
+// with the best static value are searched further, twice as many for the
+// active tile. The values of searched boards are kept in a transposition
+// table, the same board is reached by many orders of the same drops.
+#define LOOKAHEAD_DEPTH 4
+#define LOOKAHEAD_BEAM 3
+#define TRANSPOSITION_BITS 12
+
+#define LOOKAHEAD_LOST (INT_MIN / 2) // value of a board that ends the game
+
+typedef u_int64_t packedBoard;
+
+typedef struct
+{
+	packedBoard board;
+	int value;
+	unsigned char depth;   // tiles searched after the board, 0 for an empty entry
+	unsigned char gravity; // ticks per gravity step the board was searched with
+} transposition;
+
+typedef struct
+{
+	coord grid; // playfield the masks and the table are for
+	packedBoard boardMask;
+	packedBoard columnMask; // the tiles of column 0
+	packedBoard topRow;
+	packedBoard bottomRow;
+	unsigned int spawn; // column new tiles are added in
+
+	unsigned int tiles; // game.tiles when the target was planned
+	packedBoard board;	// playfield when the target was planned
+	unsigned int target;
+
+	unsigned long nodes; // boards searched in the current decision
+	unsigned long hits;	 // of these found in the table
+	transposition table[1 << TRANSPOSITION_BITS];
+} lookaheadPlanner;
+
+_Thread_local lookaheadPlanner planner;
+
+histogram decisionTime = {.name = "lookahead"}; // planning the target of a tile
+atomic_ulong lookaheadNodes;
+atomic_ulong lookaheadHits;
+
+static inline bool boardOccupied(packedBoard const board, unsigned int const x, unsigned int const y)
+{
+	return (board >> (y * planner.grid.x + x)) & 1;
+}
+
+static packedBoard packPlayfield()
+{
+	packedBoard board = 0;
+	for (unsigned int y = 0; y < game.grid.y; y++)
+		board |= (packedBoard)occupiedRow(y)[0] << (y * game.grid.x);
+	if (tileOccupied(game.activeTile))
+		board &= ~((packedBoard)1 << (game.activeTile.y * game.grid.x + game.activeTile.x));
+	return board;
+}
+
+static void initializePlanner()
+{
+	unsigned int const tiles = game.grid.x * game.grid.y;
+	planner.grid = game.grid;
+	planner.boardMask = (tiles == 64) ? ~(packedBoard)0 : ((packedBoard)1 << tiles) - 1;
+	planner.columnMask = 0;
+	for (unsigned int y = 0; y < game.grid.y; y++)
+		planner.columnMask |= (packedBoard)1 << (y * game.grid.x);
+	planner.topRow = (game.grid.y == 1) ? planner.boardMask : planner.boardMask & ~(planner.boardMask << game.grid.x);
+	planner.bottomRow = (game.grid.y == 1) ? planner.boardMask : planner.boardMask & ~(planner.boardMask >> game.grid.x);
+	planner.spawn = (game.grid.x - 1) / 2;
+	planner.tiles = UINT_MAX;
+	memset(planner.table, 0, sizeof(planner.table));
+}
+
+// Moves a tile from column x, row y towards the target column, one column
+// per tick, while gravity pulls it down on every tick with phase 0. Returns
+// the row the tile reaches the target in, or -1 if it lands or is blocked
+// on the way.
+static int reachRow(packedBoard const board, unsigned int x, unsigned int y, unsigned int phase,
+					unsigned int const gravity, unsigned int const target)
+{
+	while (x != target)
+	{
+		x = (target < x) ? x - 1 : x + 1;
+		if (boardOccupied(board, x, y))
+			return -1;
+		if (phase == 0)
+		{
+			if (y + 1 == planner.grid.y || boardOccupied(board, x, y + 1))
+				return (x == target) ? (int)y : -1;
+			y++;
+		}
+		phase = (phase + 1) % gravity;
+	}
+	return y;
+}
+
+// Drops a tile from row y of column x and clears the full rows at the
+// bottom, returns the number of cleared rows
+static unsigned int dropTile(packedBoard *const board, unsigned int const x, unsigned int y)
+{
+	while (y + 1 < planner.grid.y && !boardOccupied(*board, x, y + 1))
+		y++;
+	*board |= (packedBoard)1 << (y * planner.grid.x + x);
+	unsigned int cleared = 0;
+	while ((*board & planner.bottomRow) == planner.bottomRow)
+	{
+		*board = (planner.grid.y == 1) ? 0 : (*board << planner.grid.x) & planner.boardMask;
+		cleared++;
+	}
+	return cleared;
+}
+
+// Static value of a board: low and even stacks without holes are good, and
+// tiles in the top row are bad, new tiles cannot move past them
+static int evaluateBoard(packedBoard const board)
+{
+	// Columns a new tile can reach along the top row are first to end - 1
+	packedBoard const top = board & planner.topRow;
+	packedBoard const left = top & (((packedBoard)1 << planner.spawn) - 1);
+	packedBoard const right = top >> planner.spawn;
+	unsigned int const first = left ? 64 - __builtin_clzll(left) : 0;
+	unsigned int const end = right ? planner.spawn + __builtin_ctzll(right) : planner.grid.x;
+	int const blocked = planner.grid.x - (end - first);
+
+	int aggregate = 0, highest = 0, holes = 0, bumpiness = 0, previous = -1;
+	for (unsigned int x = 0; x < planner.grid.x; x++)
+	{
+		packedBoard const column = board & (planner.columnMask << x);
+		int height = 0;
+		if (column)
+		{
+			height = planner.grid.y - __builtin_ctzll(column) / planner.grid.x;
+			holes += height - __builtin_popcountll(column);
+		}
+		aggregate += height;
+		highest = (height > highest) ? height : highest;
+		if (previous >= 0)
+			bumpiness += abs(height - previous);
+		previous = height;
+	}
+	return -4 * aggregate - 2 * highest * highest - 12 * holes - 2 * bumpiness - 16 * blocked;
+}
+
+typedef struct
+{
+	packedBoard board; // after the drop and the cleared rows
+	unsigned int column;
+	int value; // cleared rows and moves of the drop
+	int guess; // value plus the static value of the board, to order the search
+} dropCandidate;
+
+static int searchDrops(packedBoard const board, unsigned int const depth, unsigned int const gravity);
+
+// Value of the best drop of a tile at column x, row y in the given gravity
+// phase, followed by depth more tiles. The best beam drops by static value
+// are searched deeper.
+static int bestDrop(packedBoard const board, unsigned int const x, unsigned int const y, unsigned int const phase,
+					unsigned int const depth, unsigned int const gravity, unsigned int const beam, unsigned int *const column)
+{
+	dropCandidate candidates[ROWBITS];
+	unsigned int count = 0;
+	int best = LOOKAHEAD_LOST;
 
-	// Allocate the playing field structure
-	game.rawPlayfield = (tile *)malloc(game.grid.x * game.grid.y * sizeof(tile));
-	game.playfield = (tile **)malloc(game.grid.y * sizeof(tile *));
-	if (!game.playfield || !game.rawPlayfield)
+	planner.nodes++;
+	for (unsigned int target = 0; target < planner.grid.x; target++)
+	{
+		int const row = reachRow(board, x, y, phase, gravity, target);
+		if (row < 0)
+			continue;
+		packedBoard next = board;
+		unsigned int const cleared = dropTile(&next, target, row);
+		if (boardOccupied(next, planner.spawn, 0))
+			continue; // the next tile cannot be added, the game is lost
+		// Rows are worth more than any shape of the stack, moves cost time
+		int const value = 1000 * cleared - abs((int)target - (int)x);
+		int const guess = value + evaluateBoard(next);
+		if (depth == 0)
+		{
+			if (guess > best)
+			{
+				best = guess;
+				*column = target;
+			}
+			continue;
+		}
+		// Insertion sort, best guess first
+		unsigned int i = count++;
+		for (; i > 0 && candidates[i - 1].guess < guess; i--)
+			candidates[i] = candidates[i - 1];
+		candidates[i] = (dropCandidate){next, target, value, guess};
+	}
+
+	unsigned int const expanded = (beam < count) ? beam : count;
+	for (unsigned int i = 0; i < expanded; i++)
+	{
+		int const following = searchDrops(candidates[i].board, depth - 1, gravity);
+		if (following == LOOKAHEAD_LOST)
+			continue;
+		if (candidates[i].value + following > best)
+		{
+			best = candidates[i].value + following;
+			*column = candidates[i].column;
+		}
+	}
+	return best;
+}
+
+// Value of the best drops of depth + 1 new tiles onto the board
+static int searchDrops(packedBoard const board, unsigned int const depth, unsigned int const gravity)
+{
+	u_int64_t const hash = (board ^ ((u_int64_t)depth << 56) ^ ((u_int64_t)gravity << 48)) * 0x9E3779B97F4A7C15ull;
+	transposition *const entry = &planner.table[hash >> (64 - TRANSPOSITION_BITS)];
+	if (entry->board == board && entry->depth == depth + 1 && entry->gravity == gravity)
+	{
+		planner.hits++;
+		return entry->value;
+	}
+
+	unsigned int column;
+	int const value = bestDrop(board, planner.spawn, 0, 1 % gravity, depth, gravity, LOOKAHEAD_BEAM, &column);
+	*entry = (transposition){board, value, depth + 1, gravity};
+	return value;
+}
+
+// Steers the active tile to the planned column and drops it there. A new
+// plan is made for every new tile and when rows cleared below it.
+int lookaheadKey()
+{
+	if (game.state == GAMEOVER)
+		return KEY_UP;
+	if (game.grid.x > 64 || game.grid.x * game.grid.y > 64)
+		return greedyKey();
+	if (!tileOccupied(game.activeTile))
+		return 0;
+
+	if (planner.grid.x != game.grid.x || planner.grid.y != game.grid.y)
+		initializePlanner();
+	packedBoard const board = packPlayfield();
+	if (planner.tiles != game.tiles || planner.board != board)
+	{
+		unsigned long long const nSecStart = nSecNow();
+		unsigned int const gravity = game.nextGameTick;
+		planner.nodes = 0;
+		planner.hits = 0;
+		planner.target = game.activeTile.x; // when every drop loses
+		bestDrop(board, game.activeTile.x, game.activeTile.y, game.tick, LOOKAHEAD_DEPTH - 1, gravity, 2 * LOOKAHEAD_BEAM, &planner.target);
+		planner.tiles = game.tiles;
+		planner.board = board;
+		recordHistogram(&decisionTime, nSecNow() - nSecStart);
+		atomic_fetch_add_explicit(&lookaheadNodes, planner.nodes, memory_order_relaxed);
+		atomic_fetch_add_explicit(&lookaheadHits, planner.hits, memory_order_relaxed);
+	}
+
+	if (planner.target < game.activeTile.x)
+		return KEY_LEFT;
+	if (planner.target > game.activeTile.x)
+		return KEY_RIGHT;
+	return KEY_DOWN;
+}
+
+void printLookaheadStats(FILE *const out)
+{
+	unsigned long const decisions = atomic_load_explicit(&decisionTime.samples, memory_order_relaxed);
+	if (!decisions)
+		return;
+	double const nSecTotal = (double)atomic_load_explicit(&decisionTime.nSecTotal, memory_order_relaxed);
+	unsigned long const nodes = atomic_load_explicit(&lookaheadNodes, memory_order_relaxed);
+	unsigned long const hits = atomic_load_explicit(&lookaheadHits, memory_order_relaxed);
+	fprintf(out, "  lookahead: %lu decisions, %.0f decisions/s, mean/p99/max %.1f/%.1f/%.1f us, %.1f boards/decision, %.1f%% table hits\n",
+			decisions, decisions / (nSecTotal / 1e9), nSecTotal / 1e3 / decisions,
+			histogramPercentile(&decisionTime, decisions, 99) / 1e3,
+			atomic_load_explicit(&decisionTime.nSecMax, memory_order_relaxed) / 1e3, (double)nodes / decisions,
+			100.0 * hits / (nodes + hits));
+}
+
+// Loads an input script. Every character is one tick: 'l' left, 'r' right,
+// 'd' down, 'u' up and '.' for no key. Everything else is ignored.
+bool loadScript(char const *const path)
+{
+	FILE *file = fopen(path, "r");
+	if (!file)
+		return false;
+
+	size_t capacity = 1024;
+	scriptKeys = (char *)malloc(capacity);
+	scriptLength = 0;
+	int c;
+	while (scriptKeys && (c = fgetc(file)) != EOF)
+	{
+		int key;
+		switch (c)
+		{
+		case 'l':
+			key = KEY_LEFT;
+			break;
+		case 'r':
+			key = KEY_RIGHT;
+			break;
+		case 'd':
+			key = KEY_DOWN;
+			break;
+		case 'u':
+			key = KEY_UP;
+			break;
+		case '.':
+			key = 0;
+			break;
+		default:
+			continue;
+		}
+		if (scriptLength == capacity)
+		{
+			capacity *= 2;
+			char *const grown = (char *)realloc(scriptKeys, capacity);
+			if (!grown)
+			{
+				free(scriptKeys);
+				scriptKeys = NULL;
+				break;
+			}
+			scriptKeys = grown;
+		}
+		scriptKeys[scriptLength++] = (char)key;
+	}
+	fclose(file);
+	return scriptKeys && scriptLength > 0;
+}
+
+// Distribution of the final scores of the played games. Bucket 0 counts
+// the games without score, bucket i > 0 the scores from 2^(i-1) to 2^i - 1.
+#define SCORE_BUCKETS 33
+
+// All counters are atomic so that several threads can record scores into
+// the same statistics without locking
+typedef struct
+{
+	atomic_ulong games;
+	atomic_ullong totalScore;
+	atomic_uint minScore;
+	atomic_uint maxScore;
+	atomic_ulong histogram[SCORE_BUCKETS];
+} scoreStats;
+
+#define SCORE_STATS_INIT {.minScore = UINT_MAX}
+
+void recordScore(scoreStats *const stats, unsigned int const score)
+{
+	unsigned int seen = atomic_load_explicit(&stats->minScore, memory_order_relaxed);
+	while (score < seen &&
+		   !atomic_compare_exchange_weak_explicit(&stats->minScore, &seen, score, memory_order_relaxed, memory_order_relaxed))
+	{
+	}
+	seen = atomic_load_explicit(&stats->maxScore, memory_order_relaxed);
+	while (score > seen &&
+		   !atomic_compare_exchange_weak_explicit(&stats->maxScore, &seen, score, memory_order_relaxed, memory_order_relaxed))
+	{
+	}
+	atomic_fetch_add_explicit(&stats->games, 1, memory_order_relaxed);
+	atomic_fetch_add_explicit(&stats->totalScore, score, memory_order_relaxed);
+	unsigned int const bucket = score ? 32 - __builtin_clz(score) : 0;
+	atomic_fetch_add_explicit(&stats->histogram[bucket], 1, memory_order_relaxed);
+}
+
+void printScoreStats(FILE *const out, scoreStats const *const stats)
+{
+	if (stats->games == 0)
+	{
+		fprintf(out, "  no finished games\n");
+		return;
+	}
+	fprintf(out, "  games: %lu, score min/mean/max: %u/%.2f/%u\n", (unsigned long)stats->games,
+			(unsigned int)stats->minScore, (double)stats->totalScore / stats->games, (unsigned int)stats->maxScore);
+	for (unsigned int i = 0; i < SCORE_BUCKETS; i++)
+	{
+		if (stats->histogram[i])
+		{
+			unsigned int const low = i ? 1u << (i - 1) : 0;
+			unsigned int const high = i ? low + (low - 1) : 0;
+			fprintf(out, "  score %10u - %10u: %10lu\n", low, high, (unsigned long)stats->histogram[i]);
+		}
+	}
+}
+
+// Plays the given number of ticks with the input source as fast as possible
+// and reports the tick rate together with the scores of all finished games.
+// Neither the Sense HAT nor the console are touched, the results only depend
+// on the input source and the seed of the random input.
+void runHeadless(inputSource const *const input, unsigned long const ticks, inputRecording *const recording)
+{
+	scoreStats stats = SCORE_STATS_INIT;
+	struct timespec start, end;
+
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	for (unsigned long i = 0; i < ticks; i++)
+	{
+		bool const wasActive = game.state & ACTIVE;
+		int const key = input->nextKey();
+		if (key && recording)
+			recordKey(recording, i, key);
+		sTetris(key);
+		if (wasActive && game.state == GAMEOVER)
+		{
+			recordScore(&stats, game.score);
+		}
+		advanceTick();
+	}
+	clock_gettime(CLOCK_MONOTONIC, &end);
+
+	double const nSecTotal = (double)(nSecFromTimespec(end) - nSecFromTimespec(start));
+	fprintf(stdout, "%s input: %lu ticks in %.3f s, %.0f ticks/s, %.1f ns/tick\n", input->name, ticks,
+			nSecTotal / 1e9, ticks / (nSecTotal / 1e9), nSecTotal / ticks);
+	printScoreStats(stdout, &stats);
+	if (input->nextKey == lookaheadKey)
+		printLookaheadStats(stdout);
+	if (recording)
+	{
+		closeRecording(recording, ticks - 1);
+		fprintf(stdout, "state checksum after %lu ticks: %016llx\n", ticks, (unsigned long long)stateChecksum());
+	}
+}
+
+// Self-play tournament: every strategy plays the same number of games, each
+// game is one task. The tasks are split into equal ranges per worker thread,
+// a worker that runs out of tasks steals the remaining ones of the others.
+// Game i of every strategy uses the same random seed, independent of which
+// worker plays it. The other strategies do not use the random input and
+// would play the same game every time, so after their first game they
+// open with TOURNAMENT_OPENING_TILES tiles placed by the random strategy.
+#define TOURNAMENT_OPENING_TILES 3
+
+typedef struct
+{
+	inputSource const *strategy;
+	scoreStats scores;
+	atomic_ulong ticks;	 // ticks played in all games
+	atomic_ulong capped; // games stopped at the tick limit
+} strategyResult;
+
+typedef struct tournament tournament;
+
+typedef struct
+{
+	_Alignas(64) atomic_ulong next; // next unclaimed task of this worker
+	unsigned long end;				// end of the task range of this worker
+	unsigned int index;
+	tournament *owner;
+	pthread_t thread;
+} tournamentWorker;
+
+struct tournament
+{
+	strategyResult *results;
+	unsigned int strategies;
+	unsigned long games; // games per strategy
+	unsigned long maxTicks;
+	u_int64_t seed;
+	coord grid;
+	tournamentWorker *workers;
+	unsigned int workerCount;
+	atomic_bool failed; // a worker could not allocate its playfield
+};
+
+// Claims the next task, first from the own range and then from the others
+static bool claimTask(tournament *const t, unsigned int const self, unsigned long *const task)
+{
+	for (unsigned int i = 0; i < t->workerCount; i++)
+	{
+		tournamentWorker *const victim = &t->workers[(self + i) % t->workerCount];
+		if (atomic_load_explicit(&victim->next, memory_order_relaxed) >= victim->end)
+			continue;
+		unsigned long const claimed = atomic_fetch_add_explicit(&victim->next, 1, memory_order_relaxed);
+		if (claimed < victim->end)
+		{
+			*task = claimed;
+			return true;
+		}
+	}
+	return false;
+}
+
+void *tournamentWorkerMain(void *arg)
+{
+	tournamentWorker *const worker = (tournamentWorker *)arg;
+	tournament *const t = worker->owner;
+	unsigned long task;
+
+	// game is thread local, so this allocates the playfield of this worker
+	game.grid = t->grid;
+	if (!allocatePlayfield())
 	{
 		fprintf(stderr, "ERROR: could not allocate playfield\n");
+		atomic_store_explicit(&t->failed, true, memory_order_relaxed);
+		return NULL;
+	}
+
+	while (claimTask(t, worker->index, &task))
+	{
+		strategyResult *const result = &t->results[task % t->strategies];
+		unsigned long const gameIndex = task / t->strategies;
+		unsigned long tick = 0;
+		bool const opening = gameIndex > 0 && result->strategy->nextKey != randomKey;
+
+		seedRandom(t->seed + gameIndex);
+		scriptPosition = 0;
+		resetPlayfield();
+		gameOver();
+		sTetris(KEY_UP); // Press any key to start a new game
+		while (game.state != GAMEOVER && ++tick < t->maxTicks)
+		{
+			advanceTick();
+			if (opening && game.tiles <= TOURNAMENT_OPENING_TILES)
+				sTetris(randomKey());
+			else
+				sTetris(result->strategy->nextKey());
+		}
+
+		recordScore(&result->scores, game.score);
+		atomic_fetch_add_explicit(&result->ticks, tick, memory_order_relaxed);
+		if (game.state != GAMEOVER)
+			atomic_fetch_add_explicit(&result->capped, 1, memory_order_relaxed);
+	}
+
+	freePlayfield();
+	return NULL;
+}
+
+// Plays the given number of games with every strategy on workerCount threads
+// and prints the score distribution of every strategy. Returns false when the
+// tournament could not be set up or a worker could not allocate its playfield.
+bool runTournament(inputSource const *const strategies, unsigned int const strategyCount, unsigned long const games,
+				   unsigned long const maxTicks, u_int64_t const seed, unsigned int const workerCount)
+{
+	strategyResult *const results = (strategyResult *)calloc(strategyCount, sizeof(strategyResult));
+	tournamentWorker *const workers = (tournamentWorker *)aligned_alloc(64, workerCount * sizeof(tournamentWorker));
+	if (!results || !workers)
+	{
+		free(results);
+		free(workers);
+		return false;
+	}
+
+	tournament t = {results, strategyCount, games, maxTicks, seed, game.grid, workers, workerCount};
+	atomic_init(&t.failed, false);
+	unsigned long const tasks = games * strategyCount;
+	for (unsigned int i = 0; i < strategyCount; i++)
+	{
+		results[i].strategy = &strategies[i];
+		results[i].scores = (scoreStats)SCORE_STATS_INIT;
+	}
+	for (unsigned int i = 0; i < workerCount; i++)
+	{
+		atomic_init(&workers[i].next, tasks * i / workerCount);
+		workers[i].end = tasks * (i + 1) / workerCount;
+		workers[i].index = i;
+		workers[i].owner = &t;
+	}
+
+	struct timespec start, end;
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	unsigned int started = 0;
+	while (started < workerCount && pthread_create(&workers[started].thread, NULL, tournamentWorkerMain, &workers[started]) == 0)
+	{
+		started++;
+	}
+	if (started == 0)
+	{
+		tournamentWorkerMain(&workers[0]); // no threads available, play all tasks here
+	}
+	for (unsigned int i = 0; i < started; i++)
+	{
+		pthread_join(workers[i].thread, NULL);
+	}
+	clock_gettime(CLOCK_MONOTONIC, &end);
+	if (atomic_load_explicit(&t.failed, memory_order_relaxed))
+	{
+		free(results);
+		free(workers);
+		return false;
+	}
+
+	double const seconds = (double)(nSecFromTimespec(end) - nSecFromTimespec(start)) / 1e9;
+	unsigned long totalTicks = 0;
+	for (unsigned int i = 0; i < strategyCount; i++)
+	{
+		totalTicks += results[i].ticks;
+	}
+	fprintf(stdout, "tournament: %u strategies x %lu games on %u threads in %.3f s, %.0f games/s, %.0f ticks/s\n",
+			strategyCount, games, started ? started : 1, seconds, tasks / seconds, totalTicks / seconds);
+	if (games > 1)
+		fprintf(stdout, "games after the first open with %u random tiles, except for the random strategy\n", TOURNAMENT_OPENING_TILES);
+	for (unsigned int i = 0; i < strategyCount; i++)
+	{
+		fprintf(stdout, "%s: %lu ticks, %lu games stopped at %lu ticks\n", results[i].strategy->name,
+				(unsigned long)results[i].ticks, (unsigned long)results[i].capped, maxTicks);
+		printScoreStats(stdout, &results[i].scores);
+		if (results[i].strategy->nextKey == lookaheadKey)
+			printLookaheadStats(stdout);
+	}
+
+	free(results);
+	free(workers);
+	return true;
+}
+
+void usage(char const *const program)
+{
+	fprintf(stderr, "usage: %s [-H | -T games] [-n ticks] [-s seed] [-S strategy] [-i script] [-j threads] [-m]\n"
+					"       [-w recording | -r recording] [-x width] [-y height] [-v scaled|viewport]\n"
+					"       [-f framebuffer] [-e events] [-t microseconds]\n"
+					"  -H           headless simulation, no devices and no tick delay\n"
+					"  -T games     self-play tournament, every strategy plays this many games\n"
+					"  -n ticks     ticks to simulate (default 10000000), or the tick limit\n"
+					"               of a tournament game (default 10000)\n"
+					"  -s seed      seed of the random input (default 1)\n"
+					"  -S strategy  input strategy: random, greedy, lookahead or script (default\n"
+					"               random, a tournament plays all strategies if none is given),\n"
+					"               without -H or -T it plays on the devices next to the joystick\n"
+					"  -i script    load the input script of the script strategy\n"
+					"  -j threads   tournament worker threads (default: all cores)\n"
+					"  -m           record tick timing and input latency histograms, printed\n"
+					"               to stderr on exit and on SIGUSR1\n"
+					"  -w file      record the key presses of every tick into a file\n"
+					"  -r file      replay a recording instead of reading the input devices,\n"
+					"               in real time, or as fast as possible with -H\n"
+					"  -x width     playfield columns, 1 to 65536 (default 8)\n"
+					"  -y height    playfield rows, 1 to 65536 (default 8)\n"
+					"  -v mode      how the LED matrix shows playfields larger than 8x8: scaled\n"
+					"               to 8x8 pixels (default) or an 8x8 viewport\n"
+					"  -f file      virtual framebuffer instead of the Sense HAT: a file of 8x8\n"
+					"               RGB565 pixels, e.g. in /dev/shm to share it with a viewer\n"
+					"  -e fifo      virtual joystick instead of the Sense HAT: a pipe of\n"
+					"               struct input_event records, created if it does not exist\n"
+					"  -t usec      tick time (default 10000), 0 runs the ticks without delay\n",
+			program);
+}
+
+int main(int argc, char **argv)
+{
+	static inputSource const strategies[] = {
+		{"random", randomKey},
+		{"greedy", greedyKey},
+		{"lookahead", lookaheadKey},
+		{"script", scriptKey}, // must be the last one
+	};
+	unsigned int const strategyCount = sizeof(strategies) / sizeof(strategies[0]);
+	inputSource const *strategy = NULL;
+	bool headless = false;
+	unsigned long tournamentGames = 0;
+	unsigned long ticks = 0;
+	u_int64_t seed = 1;
+	char const *scriptPath = NULL;
+	long threads = sysconf(_SC_NPROCESSORS_ONLN);
+	int option;
+	char const *recordPath = NULL;
+	char const *replayPath = NULL;
+	inputRecording recording = {0};
+	inputRecording replay = {0};
+	char const *fbPath = NULL;
+	char const *jsPath = NULL;
+	while ((option = getopt(argc, argv, "HT:n:s:S:i:j:mw:r:x:y:v:f:e:t:")) != -1)
+	{
+		switch (option)
+		{
+		case 'f':
+			fbPath = optarg;
+			break;
+		case 'e':
+			jsPath = optarg;
+			break;
+		case 't':
+			game.uSecTickTime = strtoul(optarg, NULL, 10);
+			break;
+		case 'w':
+			recordPath = optarg;
+			break;
+		case 'r':
+			replayPath = optarg;
+			break;
+		case 'm':
+			metricsEnabled = true;
+			break;
+		case 'x':
+		case 'y':
+		{
+			char *end;
+			unsigned long const size = strtoul(optarg, &end, 10);
+			if (end == optarg || *end != '\0' || size == 0 || size > GRID_MAX)
+			{
+				fprintf(stderr, "ERROR: playfield %s must be 1 to %d, not %s\n", (option == 'x') ? "width" : "height", GRID_MAX, optarg);
+				usage(argv[0]);
+				return 1;
+			}
+			if (option == 'x')
+				game.grid.x = size;
+			else
+				game.grid.y = size;
+			break;
+		}
+		case 'v':
+			if (strcmp(optarg, "scaled") == 0)
+				matrixDisplay = MATRIX_SCALED;
+			else if (strcmp(optarg, "viewport") == 0)
+				matrixDisplay = MATRIX_VIEWPORT;
+			else
+			{
+				fprintf(stderr, "ERROR: unknown matrix mode %s\n", optarg);
+				return 1;
+			}
+			break;
+		case 'H':
+			headless = true;
+			break;
+		case 'T':
+			tournamentGames = strtoul(optarg, NULL, 10);
+			break;
+		case 'S':
+			for (unsigned int i = 0; i < strategyCount; i++)
+			{
+				if (strcmp(optarg, strategies[i].name) == 0)
+					strategy = &strategies[i];
+			}
+			if (!strategy)
+			{
+				fprintf(stderr, "ERROR: unknown strategy %s\n", optarg);
+				return 1;
+			}
+			break;
+		case 'j':
+			threads = strtol(optarg, NULL, 10);
+			break;
+		case 'n':
+			ticks = strtoul(optarg, NULL, 10);
+			break;
+		case 's':
+			seed = strtoull(optarg, NULL, 10);
+			break;
+		case 'i':
+			scriptPath = optarg;
+			break;
+		default:
+			usage(argv[0]);
+			return 1;
+		}
+	}
+
+	if (scriptPath && !loadScript(scriptPath))
+	{
+		fprintf(stderr, "ERROR: could not load input script %s\n", scriptPath);
 		return 1;
 	}
-	for (unsigned int y = 0; y < game.grid.y; y++)
+	if (strategy && strategy->nextKey == scriptKey && !scriptKeys)
+	{
+		fprintf(stderr, "ERROR: the script strategy needs an input script (-i)\n");
+		return 1;
+	}
+
+	if (recordPath && replayPath)
+	{
+		fprintf(stderr, "ERROR: cannot record and replay at the same time\n");
+		return 1;
+	}
+	if (recordPath && !openRecording(&recording, recordPath, true))
+	{
+		fprintf(stderr, "ERROR: could not create recording %s\n", recordPath);
+		return 1;
+	}
+	if (replayPath && !openRecording(&replay, replayPath, false))
+	{
+		fprintf(stderr, "ERROR: could not open recording %s\n", replayPath);
+		return 1;
+	}
+
+	if (tournamentGames)
+	{
+		// Without a chosen strategy all of them play, the script only if loaded
+		bool const played = strategy ? runTournament(strategy, 1, tournamentGames, ticks ? ticks : 10000, seed, threads > 0 ? threads : 1)
+									 : runTournament(strategies, scriptKeys ? strategyCount : strategyCount - 1, tournamentGames,
+													 ticks ? ticks : 10000, seed, threads > 0 ? threads : 1);
+		free(scriptKeys);
+		if (!played)
+		{
+			fprintf(stderr, "ERROR: could not run the tournament\n");
+			return 1;
+		}
+		return 0;
+	}
+
+	if (headless)
+	{
+		if (!strategy)
+			strategy = scriptKeys ? &strategies[strategyCount - 1] : &strategies[0];
+		seedRandom(seed);
+		if (!allocatePlayfield())
+		{
+			fprintf(stderr, "ERROR: could not allocate playfield\n");
+			return 1;
+		}
+		resetPlayfield();
+		gameOver();
+		if (replay.file)
+			runReplay(&replay);
+		else
+			runHeadless(strategy, ticks ? ticks : 10000000, recording.file ? &recording : NULL);
+		closeRecording(&replay, 0);
+		freePlayfield();
+		free(scriptKeys);
+		return 0;
+	}
+
+	// This sets the stdin in a special state where each
+	// keyboard press is directly flushed to the stdin and additionally
+	// not outputted to the stdout
+	{
+		struct termios ttystate;
+		if (tcgetattr(STDIN_FILENO, &ttystate) == 0) // stdin may not be a terminal, e.g. in a benchmark
+		{
+			ttystate.c_lflag &= ~(ICANON | ECHO);
+			ttystate.c_cc[VMIN] = 1;
+			tcsetattr(STDIN_FILENO, TCSANOW, &ttystate);
+		}
+	}
+
+	// Allocate the playing field structure
+	if (!allocatePlayfield())
 	{
-		game.playfield[y] = &(game.rawPlayfield[y * game.grid.x]);
+		fprintf(stderr, "ERROR: could not allocate playfield\n");
+		return 1;
 	}
 
 	// Reset playfield to make it empty
@@ -579,45 +2636,138 @@ int main(int argc, char **argv)
 	// Start with gameOver
 	gameOver();
 
-	if (!initializeSenseHat())
+	if (!initializeSenseHat(fbPath, jsPath))
 	{
 		fprintf(stderr, "ERROR: could not initilize sense hat\n");
 		return 1;
 	};
 
+	if (!initializeFrames() || !initializeConsole(consoleView.size))
+	{
+		fprintf(stderr, "ERROR: could not allocate console renderer\n");
+		return 1;
+	}
+	if (!startRenderThread())
+	{
+		fprintf(stderr, "ERROR: could not start render thread\n");
+		return 1;
+	}
+
+	if (metricsEnabled)
+	{
+		struct sigaction action = {.sa_handler = requestMetricsDump};
+		sigemptyset(&action.sa_mask);
+		sigaction(SIGUSR1, &action, NULL);
+	}
+
 	// Clear console, render first time
-	fprintf(stdout, "\033[H\033[J");
-	renderConsole(true);
-	renderSenseHatMatrix(true);
+	publishFrame(0);
+
+	inputQueue input = {0};
+	seedRandom(seed);
+	unsigned long long nSecOrigin = nSecNow();	  // start of tick 0, all ticks are scheduled from here
+	unsigned long long nSecScheduled = nSecOrigin;	  // when the tick is scheduled to start, 0 without a tick delay
+	unsigned long long nSecLastWake = nSecOrigin;
+	unsigned long tick = 0; // ticks since the start, for recordings
+	u_int64_t checksum = 0;
 
 	while (true)
 	{
-		struct timeval sTv, eTv;
-		gettimeofday(&sTv, NULL);
-
-		int key = readSenseHatJoystick();
-		if (!key)
-			key = readKeyboard();
-		if (key == KEY_ENTER)
+		unsigned long long const nSecStart = nSecNow();
+		bool quit = false;
+		bool replayEnded = false;
+		if (replay.file)
+		{
+			replayEnded = !replayTick(&replay, tick, &input);
+		}
+		else
+		{
+			readSenseHatJoystick(&input);
+			readKeyboard(&input);
+			if (strategy) // autoplay, the devices still work, e.g. to quit
+			{
+				int const key = strategy->nextKey();
+				if (key)
+					pushInput(&input, key, nSecNow());
+			}
+		}
+		if (recording.file)
+			recordQueue(&recording, tick, &input);
+		unsigned long long const nSecInputRead = metricsEnabled ? nSecNow() : 0;
+		unsigned long long const nSecInput = (input.head != input.tail) ? input.events[input.head % INPUT_QUEUE_SIZE].nSecTime : 0;
+		bool playfieldChanged = playTick(&input, &quit);
+		unsigned long long const nSecLogic = metricsEnabled ? nSecNow() : 0;
+		if (playfieldChanged)
+			publishFrame(nSecInput);
+		if (quit)
 			break;
 
-		bool playfieldChanged = sTetris(key);
-		renderConsole(playfieldChanged);
-		renderSenseHatMatrix(playfieldChanged);
+		unsigned long long const nSecEnd = nSecNow();
+		if (metricsEnabled)
+		{
+			if (nSecScheduled)
+				recordHistogram(&tickJitter, (nSecStart > nSecScheduled) ? nSecStart - nSecScheduled : nSecScheduled - nSecStart);
+			recordHistogram(&inputTime, nSecInputRead - nSecStart);
+			recordHistogram(&logicTime, nSecLogic - nSecInputRead);
+			recordHistogram(&publishTime, nSecEnd - nSecLogic);
+			if (metricsDumpRequested)
+			{
+				metricsDumpRequested = 0;
+				dumpMetrics(stderr);
+			}
+		}
+		advanceTick();
+		if (replayEnded)
+			break;
 
-		// Wait for next tick
-		gettimeofday(&eTv, NULL);
-		unsigned long const uSecProcessTime = ((eTv.tv_sec * 1000000) + eTv.tv_usec) - ((sTv.tv_sec * 1000000 + sTv.tv_usec));
-		if (uSecProcessTime < game.uSecTickTime)
+		// Sleep until the next tick that can change the game. An autoplaying
+		// strategy may press a key on any tick.
+		unsigned long due = tick + 1;
+		if (!strategy)
 		{
-			usleep(game.uSecTickTime - uSecProcessTime);
+			due = (game.state & ACTIVE) ? due + (game.nextGameTick - game.tick) % game.nextGameTick : ULONG_MAX;
+			if (replay.file && (!replay.pending || replay.tick < due))
+				due = replay.pending ? replay.tick : tick + 1;
 		}
-		game.tick = (game.tick + 1) % game.nextGameTick;
+		levelActivity *const activity = activityOf(game.state, game.level);
+		unsigned long const next = waitForTick(tick + 1, due, !replay.file, &nSecOrigin, &nSecScheduled);
+		unsigned long long const nSecWake = nSecNow();
+		activity->ticks += next - tick;
+		activity->wakeups++;
+		activity->nSec += nSecWake - nSecLastWake;
+		nSecLastWake = nSecWake;
+		tick = next;
+	}
+
+	if (recording.file || replay.file)
+	{
+		closeRecording(&recording, tick);
+		closeRecording(&replay, 0);
+		checksum = stateChecksum();
 	}
 
+	stopRenderThread();
 	freeSenseHat();
-	free(game.playfield);
-	free(game.rawPlayfield);
+	freeConsole();
+	freeFrames();
+	freePlayfield();
+	printSchedulerActivity(stdout);
+	if (input.dropped)
+	{
+		fprintf(stdout, "input: %lu key presses dropped, queue full\n", input.dropped);
+	}
+	if (strategy && strategy->nextKey == lookaheadKey)
+	{
+		printLookaheadStats(stdout);
+	}
+	if (checksum)
+	{
+		fprintf(stdout, "state checksum after %lu ticks: %016llx\n", tick + 1, (unsigned long long)checksum);
+	}
+	if (metricsEnabled)
+	{
+		dumpMetrics(stderr);
+	}
 
 	return 0;
 }
\ No newline at end of file